@@ -6,7 +6,8 @@ enum tinyev_err {
     TINYEV_ERR_INIT,
     TINYEV_ERR_POLL,
     TINYEV_ERR_ADD,
-    TINYEV_ERR_MEM
+    TINYEV_ERR_MEM,
+    TINYEV_ERR_HANDOFF
 };
 
 #endif /* __ERROR_H__ */
@@ -2,9 +2,20 @@
 #define __TINYEV_H__
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
 #include "error.h"
+#include "tinyev_buf.h"
+#include "tinyev_hist.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define TINYEV_MAX_TNAME_LEN 16
+#define TINYEV_READ_SIZE 4096       // Default read size of tinyev_add_reader()
+#define TINYEV_EOF (-4095)          // Read callback nread when the peer closed
 
 /* List of events that tinyev supports.
     Note: setting up send event will cause the CPU 100% usage
@@ -13,7 +24,21 @@ enum tinyev_events {
     TEV_RECV = 1 << 0,      // Ready to read
     TEV_SEND = 1 << 1,      // Ready to send
     TEV_CLOSE = 1 << 2,     // Close event
-    TEV_ERROR = 1 << 3      // Something went bad
+    TEV_ERROR = 1 << 3,     // Something went bad
+    TEV_EDGE = 1 << 4,      // Edge triggered, report only state changes
+    TEV_INTERNAL = 1 << 5   // Helper fd of a module, not counted by tinyev_waiting() or rate limited
+};
+
+/* Kernel software timestamps, see tinyev_set_timestamping(). */
+enum tinyev_ts_flags {
+    TINYEV_TS_RX = 1 << 0,  // When the data was received
+    TINYEV_TS_TX = 1 << 1   // When the data was handed to the device
+};
+
+/* Directions of tinyev_set_rate(). */
+enum tinyev_rate_dir {
+    TINYEV_RATE_READ = 0,
+    TINYEV_RATE_WRITE
 };
 
 /**
@@ -22,6 +47,61 @@ enum tinyev_events {
  */
 typedef void (*event_cb)(void*);
 
+/**
+ * @brief fills buf with a buffer to read into, receives the user data and
+ * the suggested size. Leave buf->base NULL if there's no memory.
+ */
+typedef void (*tinyev_alloc_cb)(void*, size_t, struct tinyev_buf*);
+
+/**
+ * @brief called with the user data, the read result and the buffer:
+ * nread > 0 bytes read, 0 nothing to read after all, TINYEV_EOF when the
+ * peer closed, any other negative value is -errno. The buffer belongs to
+ * the callback in all cases.
+ */
+typedef void (*tinyev_read_cb)(void*, ssize_t, struct tinyev_buf*);
+
+/**
+ * @brief loop clock, receives the clock data and returns the time in
+ * millisecs. It must never go backwards.
+ */
+typedef uint64_t (*tinyev_clock_fn)(void*);
+
+/**
+ * @brief TX timestamp callback, receives the user data, the send id and
+ * the kernel timestamp (CLOCK_REALTIME). For TCP the id is the byte
+ * offset of the last byte of the send since timestamping was turned on,
+ * for datagrams it counts the sends.
+ */
+typedef void (*tinyev_tx_ts_cb)(void*, uint32_t, const struct timespec*);
+
+/* Loop counters, see tinyev_get_stats(). */
+struct tinyev_stats {
+    uint64_t wakeups;           // Returns from the poll syscall
+    uint64_t timer_wakeups;     // Wakeups that fired at least one timer
+    uint64_t timers_fired;      // Timer callbacks called
+    uint64_t wakeups_saved;     // Requested times moved onto a shared wakeup by slack
+    uint64_t idle_timeouts;     // Idle callbacks called
+    uint64_t signals;           // Signals read from the signalfd
+    uint64_t timer_late_msec;   // Sum of fire time minus requested time
+    uint64_t timer_late_max;    // Worst of them
+    uint64_t timers_reordered;  // Fired before a timer requested earlier
+    uint64_t rx_stamped;        // Reads that came with a kernel RX timestamp
+    uint64_t tx_stamps;         // TX timestamps read from error queues
+    uint64_t writes_corked;     // tinyev_write() calls
+    uint64_t write_syscalls;    // write() calls that flushed them
+    uint64_t throttles;         // Times an fd ran out of rate tokens
+    uint64_t throttled_msec;    // Time fds spent paused for tokens, summed
+};
+
+/* Token bucket limit, see tinyev_set_rate(). Zero fields are unlimited. */
+struct tinyev_rate {
+    uint64_t bytes_sec;         // Bytes per second
+    uint64_t ops_sec;           // Callbacks or write() calls per second
+    uint64_t burst_bytes;       // Bucket size, 0 for a tenth of bytes_sec
+    uint64_t burst_ops;         // Bucket size, 0 for a tenth of ops_sec
+};
+
 enum tinyev_event {
     TINYEV_EVENT_TO = 0,
     TINYEV_EVENT_READ,
@@ -38,8 +118,8 @@ bool tinyev_waiting();
 
 /**
  * @brief wait for events with timeout. Please be advised - the lower to
- * timeout (msec var) the more we run and use the CPU but also we have
- * low-latency and persision.
+ * timeout (msec var) the more we run and use the CPU. The wait is cut
+ * short when a timer is due before msec passes.
  * 
  * @param msec  maximum time to poll.
  * @return int  TINYEV_OK if all went well, any other error otherwise.
@@ -48,8 +128,7 @@ int tinyev_poll(int msec);
 
 /**
  * @brief add a one-time triggered timer after some time the user
- * wants to. The presision of this call is up to poll timout that
- * the user calls tinyev_poll() with.
+ * wants to. tinyev_poll() returns early to fire it on time.
  * 
  * @param sec       seconds timeout
  * @param msec      milli seconds timeout
@@ -61,8 +140,7 @@ void* tinyev_add_timer(int sec, int msec, void* data, event_cb cb);
 
 /**
  * @brief adds a periodic timer that is being called every secs + msecs
- * and call the callback. The presision of this call is up to poll timout that
- * the user calls tinyev_poll() with.
+ * and call the callback. tinyev_poll() returns early to fire it on time.
  * 
  * @param sec       seconds timeout
  * @param msec      milli seconds timeout
@@ -72,13 +150,50 @@ void* tinyev_add_timer(int sec, int msec, void* data, event_cb cb);
  */
 void* tinyev_add_periodic(int sec, int msec, void* data, event_cb cb);
 
+/**
+ * @brief same as tinyev_add_timer(), but the timer may fire up to slack
+ * millisecs late. The loop uses that to fire nearby timers together in
+ * one wakeup. A slack of 0 is a precise timer.
+ *
+ * @param sec       seconds timeout
+ * @param msec      milli seconds timeout
+ * @param slack     allowed lateness in milli seconds
+ * @param data      user data to call the callback with
+ * @param cb        user callback
+ * @return void*    timer object
+ */
+void* tinyev_add_timer_slack(int sec, int msec, int slack, void* data, event_cb cb);
+
+/**
+ * @brief same as tinyev_add_periodic(), with slack millisecs of allowed
+ * lateness on every period, see tinyev_add_timer_slack().
+ *
+ * @param sec       seconds timeout
+ * @param msec      milli seconds timeout
+ * @param slack     allowed lateness in milli seconds
+ * @param data      user data to call the callback with
+ * @param cb        user callback
+ * @return void*    timer object
+ */
+void* tinyev_add_periodic_slack(int sec, int msec, int slack, void* data, event_cb cb);
+
 /**
  * @brief remove timer from timers list. Can either periodic or not.
+ * Unlinked in O(1). Deleting a one-shot timer that fired already does
+ * nothing, as long as no timer was added since: its object may be reused.
  * 
  * @param tobj timer object pointer.
  */
 void tinyev_del_timer(void* tobj);
 
+/**
+ * @brief change the user data a timer is called with.
+ *
+ * @param tobj timer object pointer.
+ * @param data new user data.
+ */
+void tinyev_timer_set_data(void *tobj, void *data);
+
 /**
  * @brief adds file descriptor to poll on. All of the file descriptors
  * will be non blocking at the end of this function!
@@ -93,12 +208,258 @@ void tinyev_del_timer(void* tobj);
 void *tinyev_add_fd(int fd, void* data, event_cb cb, enum tinyev_events events, int *err);
 
 /**
- * @brief remove fd and close it.
+ * @brief adds file descriptor that tinyev reads from by itself. A buffer
+ * is taken only once the fd is readable: from alloc_cb, or from the
+ * tinyev_buf pool when alloc_cb is NULL. The read is handed to read_cb,
+ * which must release the buffer (tinyev_buf_free() for pool buffers) once
+ * done with the data, so idle fds hold no buffer at all.
+ *
+ * @param fd        the file descriptor to read from
+ * @param data      user data.
+ * @param suggested buffer size to ask for, 0 for TINYEV_READ_SIZE.
+ * @param alloc_cb  buffer allocator, NULL to use the pool.
+ * @param read_cb   user call back with every read.
+ * @param err       pointer to error as return code.
+ * @return void*    returns pointer to new event object.
+ */
+void *tinyev_add_reader(int fd, void* data, size_t suggested, tinyev_alloc_cb alloc_cb,
+                        tinyev_read_cb read_cb, int *err);
+
+/**
+ * @brief remove fd and close it. Corked data is written first if the fd
+ * can take it.
  * 
  * @param fd to remove.
  */
 void tinyev_remove_fd(int fd, void *ev_data);
 
+/**
+ * @brief stop watching fd but leave it open, e.g. to hand it over to
+ * another owner. Corked data is written first if the fd can take it.
+ *
+ * @param fd    to stop watching.
+ * @param evobj event object of the fd.
+ */
+void tinyev_detach_fd(int fd, void *evobj);
+
+/**
+ * @brief call cb with data later in this loop iteration: after the fd
+ * callbacks, or after the timer and idle callbacks when queued by them.
+ * Callbacks deferred by a deferred callback run in the next iteration,
+ * which then does not wait.
+ *
+ * @param cb    callback.
+ * @param data  user data to call cb with.
+ * @return int  TINYEV_OK if all went well, TINYEV_ERR_MEM otherwise.
+ */
+int tinyev_defer(event_cb cb, void *data);
+
+/**
+ * @brief corked write: buf is copied aside and everything written to the
+ * fd in this loop iteration goes out in one write() when the fd callbacks
+ * are done (see tinyev_defer()). What the socket can't take is written
+ * when it's writable again, meanwhile writes keep being added in order.
+ * Once the corked data and buf are over 64KB they are written right away
+ * with writev(), buf is not copied then and only what the socket doesn't
+ * take is corked.
+ *
+ * @param evobj     event object of the fd.
+ * @param buf       data to write.
+ * @param len       buf length.
+ * @return ssize_t  len, fewer bytes if some of buf was written right away
+ *                  but the rest can't be corked, -ENOBUFS when over 4MB
+ *                  are waiting or there's no memory, or the -errno of a
+ *                  write that failed, the corked data is dropped then.
+ */
+ssize_t tinyev_write(void *evobj, const void *buf, size_t len);
+
+/**
+ * @brief change the user data an fd's callbacks are called with.
+ *
+ * @param evobj event object returned by tinyev_add_fd() or
+ *              tinyev_add_reader().
+ * @param data  new user data.
+ */
+void tinyev_set_data(void *evobj, void *data);
+
+/**
+ * @brief limit the reads or writes of an fd, or of the whole loop with a
+ * NULL evobj, with token buckets. An fd out of tokens, its own or the
+ * loop's, stops watching that direction and a loop timer watches it again
+ * once the buckets refill. A read op is a callback on a readable fd, a
+ * write op a callback on a writable fd or a write() of corked data.
+ * Bytes are counted for tinyev_add_reader() reads and tinyev_write()
+ * data, fds that do their own I/O report it with tinyev_rate_charge().
+ * An op may overdraw the bucket, the fd waits until it's paid back.
+ *
+ * @param evobj     event object of the fd, NULL for the loop.
+ * @param dir       TINYEV_RATE_READ or TINYEV_RATE_WRITE.
+ * @param rate      the limit, NULL to remove it. Buckets start full.
+ * @return int      TINYEV_OK if all went well, TINYEV_ERR_MEM otherwise.
+ */
+int tinyev_set_rate(void *evobj, enum tinyev_rate_dir dir, const struct tinyev_rate *rate);
+
+/**
+ * @brief take bytes the user read or wrote by itself from the fd's and
+ * the loop's buckets, see tinyev_set_rate().
+ *
+ * @param evobj     event object of the fd.
+ * @param dir       TINYEV_RATE_READ or TINYEV_RATE_WRITE.
+ * @param bytes     bytes read or written.
+ */
+void tinyev_rate_charge(void *evobj, enum tinyev_rate_dir dir, size_t bytes);
+
+/**
+ * @brief time the fd spent paused for rate tokens so far, millisecs.
+ *
+ * @param evobj     event object of the fd.
+ */
+uint64_t tinyev_throttled_msec(void *evobj);
+
+/**
+ * @brief close idle fds: call cb with the fd's user data once the fd was
+ * not touched for msec millisecs. The callback fires once and the fd stays
+ * in tinyev, usually the callback removes it with tinyev_remove_fd().
+ * Calling this again re-arms the timeout, msec 0 stops tracking.
+ *
+ * @param evobj     event object returned by tinyev_add_fd().
+ * @param msec      idle timeout in millisecs.
+ * @param cb        user callback, called with the fd's user data.
+ * @return int      TINYEV_OK if all went well, any other error otherwise.
+ */
+int tinyev_set_idle(void *evobj, int msec, event_cb cb);
+
+/**
+ * @brief mark the fd as active now, pushing its idle timeout back. Only
+ * stores the current loop time, no list or syscall work.
+ *
+ * @param evobj     event object returned by tinyev_add_fd().
+ */
+void tinyev_touch(void *evobj);
+
+/**
+ * @brief handle a signal in the loop. The signal is blocked and read from
+ * a signalfd shared by all signals, so cb runs from tinyev_poll() like any
+ * other callback and may call any tinyev function. It's blocked in the
+ * calling thread only, and a signalfd only gets the signals that every
+ * thread blocks: block it in the other threads too, best by adding it
+ * before they are created. The connect and file threads block all signals.
+ *
+ * @param signo     signal number.
+ * @param cb        user callback.
+ * @param data      user data to call the callback with.
+ * @return int      TINYEV_OK if all went well, any other error otherwise.
+ */
+int tinyev_add_signal(int signo, event_cb cb, void *data);
+
+/**
+ * @brief stop handling a signal and unblock it.
+ *
+ * @param signo     signal number.
+ */
+void tinyev_del_signal(int signo);
+
+/**
+ * @brief copy the loop counters.
+ *
+ * @param st    filled with the current counters.
+ */
+void tinyev_get_stats(struct tinyev_stats *st);
+
+/**
+ * @brief turn on kernel software timestamps for a socket. With
+ * TINYEV_TS_RX loop driven reads (tinyev_add_reader()) go through
+ * recvmsg(), see tinyev_rx_timestamp(), and the delay from the kernel
+ * receiving the data to the read callback starting is recorded, see
+ * tinyev_get_rx_delay(). With TINYEV_TS_TX the error queue is drained in
+ * tinyev_poll() and tx_cb called for every timestamp, before the fd
+ * callback. Don't remove the fd from tx_cb.
+ *
+ * @param evobj     event object of the socket.
+ * @param flags     enum tinyev_ts_flags, 0 to turn off.
+ * @param tx_cb     TX timestamp callback, may be NULL.
+ * @return int      TINYEV_OK if all went well, TINYEV_ERR_ADD otherwise.
+ */
+int tinyev_set_timestamping(void *evobj, int flags, tinyev_tx_ts_cb tx_cb);
+
+/**
+ * @brief kernel RX timestamp of the last loop driven read, valid in the
+ * read callback. For TCP it's the time of the latest data read.
+ *
+ * @param evobj     event object of the socket.
+ * @param ts        filled with the timestamp (CLOCK_REALTIME).
+ * @return true     the read had a timestamp.
+ * @return false    no timestamp.
+ */
+bool tinyev_rx_timestamp(void *evobj, struct timespec *ts);
+
+/**
+ * @brief read() that also returns the kernel RX timestamp, for fds read
+ * by the user. ts is zeroed when there is none.
+ *
+ * @return ssize_t  like read().
+ */
+ssize_t tinyev_recv_ts(int fd, void *buf, size_t len, struct timespec *ts);
+
+/**
+ * @brief copy the histogram of kernel RX to read callback delays, in
+ * nanosecs, recorded since tinyev_init() or tinyev_reset_rx_delay().
+ *
+ * @param h     filled with the histogram.
+ */
+void tinyev_get_rx_delay(struct tinyev_hist *h);
+
+/**
+ * @brief empty the histogram of kernel RX to read callback delays, e.g.
+ * after a warmup.
+ */
+void tinyev_reset_rx_delay();
+
+/**
+ * @brief also record how late each timer fired, in millisecs after its
+ * requested time, in h. The histogram is not reset.
+ *
+ * @param h     histogram to fill, NULL to stop.
+ */
+void tinyev_set_lateness_hist(struct tinyev_hist *h);
+
+/**
+ * @brief current loop time in millisecs, as used for timers.
+ */
+uint64_t tinyev_now();
+
+/**
+ * @brief replace the loop clock, gettimeofday() by default. Call it
+ * before adding timers or idle timeouts, they are not moved over.
+ *
+ * @param fn        clock function, NULL for the default.
+ * @param data      data to call fn with.
+ */
+void tinyev_set_clock(tinyev_clock_fn fn, void *data);
+
+/**
+ * @brief switch to simulated time starting at start_msec. tinyev_poll()
+ * never sleeps: when nothing is ready it moves the clock straight to the
+ * next timer, idle deadline or injected event, or by msec if that's
+ * sooner. Real fds are still polled, without waiting.
+ *
+ * @param start_msec    initial loop time.
+ */
+void tinyev_sim_start(uint64_t start_msec);
+
+/**
+ * @brief replay fd readiness: evobj is dispatched as if its fd was ready
+ * when the simulated clock reaches at_msec. Events given in time order
+ * are queued in O(1). Dropped when the fd is removed.
+ *
+ * @param evobj     event object returned by tinyev_add_fd() or
+ *                  tinyev_add_reader().
+ * @param at_msec   simulated time to dispatch at.
+ * @return int      TINYEV_OK if all went well, TINYEV_ERR_ADD when not
+ *                  simulating, TINYEV_ERR_MEM if there's no memory.
+ */
+int tinyev_sim_inject(void *evobj, uint64_t at_msec);
+
 /**
  * @brief start things up.
  * 
@@ -112,4 +473,8 @@ int tinyev_init();
  */
 void tinyev_cleanup();
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __TINYEV_H__ */
@@ -0,0 +1,373 @@
+#ifndef __TINYEV_HPP__
+#define __TINYEV_HPP__
+
+/* C++17 wrapper for tinyev, header only. Callables are kept inside the
+    handles, no std::function and no allocation, and tinyev calls a
+    trampoline made for the callable's type, so a dispatch is the same one
+    indirect call as with the C API. */
+
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "tinyev.h"
+
+#ifndef TINYEV_INLINE_SIZE
+#   define TINYEV_INLINE_SIZE 48    // Bytes of captures a handle can hold
+#endif
+
+namespace tinyev {
+
+namespace detail {
+
+/* Type erased storage for one callable, only moving and destroying go
+    through a function pointer. */
+class InlineBox {
+public:
+    InlineBox() noexcept = default;
+    InlineBox(const InlineBox &) = delete;
+    InlineBox &operator=(const InlineBox &) = delete;
+
+    ~InlineBox() { reset(); }
+
+    template <typename F>
+    void emplace(F &&f)
+    {
+        using T = std::decay_t<F>;
+
+        static_assert(sizeof(T) <= TINYEV_INLINE_SIZE,
+                      "callable too big to keep inline, capture less or raise TINYEV_INLINE_SIZE");
+        static_assert(alignof(T) <= alignof(std::max_align_t), "callable over aligned");
+        static_assert(std::is_nothrow_move_constructible_v<T>, "callable must move without throwing");
+
+        reset();
+        new (buf_) T(std::forward<F>(f));
+        ops_ = [](void *dst, void *src) noexcept {
+            if (dst)
+                new (dst) T(std::move(*static_cast<T *>(src)));
+            static_cast<T *>(src)->~T();
+        };
+    }
+
+    /* Take over other's callable, other is left empty. */
+    void take(InlineBox &other) noexcept
+    {
+        reset();
+        if (other.ops_) {
+            other.ops_(buf_, other.buf_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+    }
+
+    void reset() noexcept
+    {
+        if (ops_) {
+            ops_(nullptr, buf_);
+            ops_ = nullptr;
+        }
+    }
+
+    template <typename T>
+    T &get() noexcept { return *std::launder(reinterpret_cast<T *>(buf_)); }
+
+private:
+    alignas(std::max_align_t) unsigned char buf_[TINYEV_INLINE_SIZE];
+    void (*ops_)(void *, void *) noexcept = nullptr;
+};
+
+inline int to_msec(std::chrono::milliseconds t)
+{
+    return static_cast<int>(t.count());
+}
+
+} // namespace detail
+
+/**
+ * @brief callable that calls Method on obj, for handles driven by a
+ * member function: tinyev::Timer t(1s, tinyev::bind<&Conn::on_timer>(this));
+ */
+template <auto Method, typename T>
+auto bind(T *obj) noexcept
+{
+    return [obj](auto &&...args) { return (obj->*Method)(std::forward<decltype(args)>(args)...); };
+}
+
+/* Timer, one-shot or periodic, deleted with the handle. The callable
+    lives in the handle, so the handle must not be destroyed or assigned to
+    from its own callback, cancel() is fine. */
+class Timer {
+public:
+    Timer() noexcept = default;
+
+    /**
+     * @brief one-shot timer calling f() after t, up to slack later.
+     */
+    template <typename F>
+    Timer(std::chrono::milliseconds t, F &&f, std::chrono::milliseconds slack = {})
+    {
+        arm(t, std::forward<F>(f), slack, false);
+    }
+
+    /**
+     * @brief periodic timer calling f() every t, up to slack later.
+     */
+    template <typename F>
+    static Timer every(std::chrono::milliseconds t, F &&f, std::chrono::milliseconds slack = {})
+    {
+        Timer timer;
+
+        timer.arm(t, std::forward<F>(f), slack, true);
+
+        return timer;
+    }
+
+    Timer(Timer &&other) noexcept { take(other); }
+
+    Timer &operator=(Timer &&other) noexcept
+    {
+        if (this != &other) {
+            cancel();
+            take(other);
+        }
+        return *this;
+    }
+
+    ~Timer() { cancel(); }
+
+    /**
+     * @brief delete the timer now. Safe from its own callback, the
+     * callable is kept until the handle goes away.
+     */
+    void cancel() noexcept
+    {
+        if (tobj_) {
+            tinyev_del_timer(tobj_);
+            tobj_ = nullptr;
+        }
+    }
+
+    /**
+     * @brief the timer is still going to fire.
+     */
+    bool active() const noexcept { return tobj_ != nullptr; }
+
+    /**
+     * @brief false if the timer could not be added.
+     */
+    bool ok() const noexcept { return err_ == TINYEV_ERR_OK; }
+    int error() const noexcept { return err_; }
+
+private:
+    template <typename F>
+    static void trampoline(void *udata)
+    {
+        Timer *t = static_cast<Timer *>(udata);
+
+        /* A one-shot timer is released by tinyev once this returns. */
+        if (!t->periodic_)
+            t->tobj_ = nullptr;
+        t->fn_.get<std::decay_t<F>>()();
+    }
+
+    template <typename F>
+    void arm(std::chrono::milliseconds t, F &&f, std::chrono::milliseconds slack, bool periodic)
+    {
+        fn_.emplace(std::forward<F>(f));
+        periodic_ = periodic;
+        if (periodic)
+            tobj_ = tinyev_add_periodic_slack(0, detail::to_msec(t), detail::to_msec(slack), this,
+                                              &trampoline<F>);
+        else
+            tobj_ = tinyev_add_timer_slack(0, detail::to_msec(t), detail::to_msec(slack), this,
+                                           &trampoline<F>);
+        err_ = tobj_ ? TINYEV_ERR_OK : TINYEV_ERR_MEM;
+    }
+
+    void take(Timer &other) noexcept
+    {
+        fn_.take(other.fn_);
+        tobj_ = other.tobj_;
+        periodic_ = other.periodic_;
+        err_ = other.err_;
+        other.tobj_ = nullptr;
+        if (tobj_)
+            tinyev_timer_set_data(tobj_, this);
+    }
+
+    detail::InlineBox fn_;
+    void *tobj_ = nullptr;
+    bool periodic_ = false;
+    int err_ = TINYEV_ERR_OK;
+};
+
+/* Watched fd, removed and closed with the handle. The fd's user data is
+    the handle, so it must not be used with C calls that hand the user
+    data to another callback, such as tinyev_set_idle(). Like with Timer,
+    close() is fine from the callback but destroying the handle is not. */
+class Fd {
+public:
+    Fd() noexcept = default;
+
+    /**
+     * @brief watch fd for events (enum tinyev_events), calling f() when
+     * one occurs. The user reads the fd.
+     */
+    template <typename F>
+    Fd(int fd, int events, F &&f) : fd_(fd)
+    {
+        fn_.emplace(std::forward<F>(f));
+        evobj_ = tinyev_add_fd(fd, this, &trampoline<F>, static_cast<enum tinyev_events>(events), &err_);
+    }
+
+    /**
+     * @brief fd read by tinyev, see tinyev_add_reader(). f(nread, buf) is
+     * called with the read result and the buffer, that goes back to the
+     * pool when f returns unless f sets buf.base to nullptr to keep it.
+     */
+    template <typename F>
+    static Fd reader(int fd, F &&f, size_t suggested = 0)
+    {
+        Fd h;
+
+        h.fd_ = fd;
+        h.fn_.emplace(std::forward<F>(f));
+        h.evobj_ = tinyev_add_reader(fd, &h, suggested, nullptr, &read_trampoline<F>, &h.err_);
+
+        return h;
+    }
+
+    Fd(Fd &&other) noexcept { take(other); }
+
+    Fd &operator=(Fd &&other) noexcept
+    {
+        if (this != &other) {
+            close();
+            take(other);
+        }
+        return *this;
+    }
+
+    ~Fd() { close(); }
+
+    /**
+     * @brief remove the fd from tinyev and close it.
+     */
+    void close() noexcept
+    {
+        if (evobj_) {
+            tinyev_remove_fd(fd_, evobj_);
+            evobj_ = nullptr;
+            fd_ = -1;
+        }
+    }
+
+    /**
+     * @brief for tinyev_touch() and the other C calls taking an evobj.
+     */
+    void *evobj() const noexcept { return evobj_; }
+    int fd() const noexcept { return fd_; }
+
+    /**
+     * @brief false if the fd could not be added.
+     */
+    bool ok() const noexcept { return evobj_ != nullptr; }
+    int error() const noexcept { return err_; }
+
+private:
+    template <typename F>
+    static void trampoline(void *udata)
+    {
+        static_cast<Fd *>(udata)->fn_.get<std::decay_t<F>>()();
+    }
+
+    template <typename F>
+    static void read_trampoline(void *udata, ssize_t nread, struct tinyev_buf *buf)
+    {
+        static_cast<Fd *>(udata)->fn_.get<std::decay_t<F>>()(nread, *buf);
+        if (buf->base)
+            tinyev_buf_free(buf);
+    }
+
+    void take(Fd &other) noexcept
+    {
+        fn_.take(other.fn_);
+        evobj_ = other.evobj_;
+        fd_ = other.fd_;
+        err_ = other.err_;
+        other.evobj_ = nullptr;
+        other.fd_ = -1;
+        if (evobj_)
+            tinyev_set_data(evobj_, this);
+    }
+
+    detail::InlineBox fn_;
+    void *evobj_ = nullptr;
+    int fd_ = -1;
+    int err_ = TINYEV_ERR_OK;
+};
+
+/* The tinyev loop, one per process: started with the handle and cleaned
+    up with it. Fds and timers should go away before it does. */
+class Loop {
+public:
+    Loop() noexcept : err_(tinyev_init()) {}
+    Loop(const Loop &) = delete;
+    Loop &operator=(const Loop &) = delete;
+
+    ~Loop()
+    {
+        if (err_ == TINYEV_ERR_OK)
+            tinyev_cleanup();
+    }
+
+    /**
+     * @brief false if tinyev could not start.
+     */
+    bool ok() const noexcept { return err_ == TINYEV_ERR_OK; }
+    int error() const noexcept { return err_; }
+
+    /**
+     * @brief one loop iteration, see tinyev_poll().
+     */
+    int poll(int msec = -1) noexcept { return tinyev_poll(msec); }
+
+    /**
+     * @brief poll until stop() or nothing is watched anymore.
+     *
+     * @return int  TINYEV_OK, or the tinyev_poll() error that ended it.
+     */
+    int run() noexcept
+    {
+        int err = TINYEV_ERR_OK;
+
+        stopped_ = false;
+        while (!stopped_ && tinyev_waiting() && err == TINYEV_ERR_OK)
+            err = tinyev_poll(-1);
+
+        return err;
+    }
+
+    void stop() noexcept { stopped_ = true; }
+
+    uint64_t now() const noexcept { return tinyev_now(); }
+
+    struct tinyev_stats stats() const noexcept
+    {
+        struct tinyev_stats st;
+
+        tinyev_get_stats(&st);
+
+        return st;
+    }
+
+private:
+    int err_;
+    bool stopped_ = false;
+};
+
+} // namespace tinyev
+
+#endif /* __TINYEV_HPP__ */
@@ -0,0 +1,63 @@
+#ifndef __TINYEV_BUF_H__
+#define __TINYEV_BUF_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pool flags, see tinyev_buf_pool_config(). */
+enum tinyev_buf_flags {
+    TINYEV_BUF_HUGE = 1 << 0        // Back the pool with 2MB huge pages
+};
+
+/* A buffer handed to the user, base is NULL when allocation failed. */
+struct tinyev_buf {
+    char *base;
+    size_t len;
+};
+
+/**
+ * @brief set up the pool, call before the first allocation. With
+ * TINYEV_BUF_HUGE the pool asks for explicit huge pages and falls back to
+ * transparent huge pages when there are none reserved.
+ *
+ * @param flags     enum tinyev_buf_flags.
+ */
+void tinyev_buf_pool_config(int flags);
+
+/**
+ * @brief take a buffer of at least size bytes from the pool. Buffers come
+ * in a few size classes, len is set to the size of the class. Bigger
+ * requests go to malloc.
+ *
+ * @param size      wanted size.
+ * @param buf       filled with the buffer.
+ * @return int      TINYEV_OK if all went well, TINYEV_ERR_MEM otherwise.
+ */
+int tinyev_buf_alloc(size_t size, struct tinyev_buf *buf);
+
+/**
+ * @brief give a buffer back to the pool. Only for buffers that came from
+ * tinyev_buf_alloc().
+ *
+ * @param buf       buffer to return, base is set to NULL.
+ */
+void tinyev_buf_free(struct tinyev_buf *buf);
+
+/**
+ * @brief bytes mapped by the pool and bytes handed out right now.
+ */
+void tinyev_buf_pool_usage(size_t *mapped, size_t *in_use);
+
+/**
+ * @brief unmap the whole pool, all buffers must have been returned.
+ */
+void tinyev_buf_pool_cleanup();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TINYEV_BUF_H__ */
@@ -0,0 +1,97 @@
+#ifndef __TINYEV_CO_H__
+#define __TINYEV_CO_H__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "tinyev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief coroutine body, receives the argument given to tinyev_co_spawn().
+ */
+typedef void (*tinyev_co_fn)(void*);
+
+/**
+ * @brief start a new coroutine. The coroutine runs right away, until it
+ * first waits on an fd or a timer, and then it is resumed by tinyev_poll().
+ * Stacks are taken from a pool and have a guard page below them, so a
+ * stack overflow crashes instead of silently corrupting memory.
+ *
+ * @param fn        coroutine body
+ * @param arg       argument to call fn with
+ * @return int      TINYEV_ERR_OK if all went well, TINYEV_ERR_MEM otherwise.
+ */
+int tinyev_co_spawn(tinyev_co_fn fn, void *arg);
+
+/**
+ * @brief read from fd, suspending the calling coroutine until the fd is
+ * readable. The fd is added to tinyev on first use and is non blocking
+ * from then on. Must be called from a coroutine.
+ *
+ * @return ssize_t  same as read(2), never -1 with EAGAIN.
+ */
+ssize_t tinyev_co_read(int fd, void *buf, size_t len);
+
+/**
+ * @brief write all of buf to fd, suspending the calling coroutine whenever
+ * the fd is not writable. Must be called from a coroutine.
+ *
+ * @return ssize_t  len if all was written, -1 on error (errno is set).
+ */
+ssize_t tinyev_co_write(int fd, const void *buf, size_t len);
+
+/**
+ * @brief accept a connection on a listening fd, suspending the calling
+ * coroutine until one arrives. Must be called from a coroutine.
+ *
+ * @return int      new socket, or -1 on error (errno is set).
+ */
+int tinyev_co_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * @brief suspend the calling coroutine for secs + msecs.
+ * Must be called from a coroutine.
+ */
+void tinyev_co_sleep(int sec, int msec);
+
+/**
+ * @brief remove fd from tinyev and close it. Use this instead of close(2)
+ * for fds that were used by the tinyev_co_* calls. Coroutines waiting on
+ * fd are resumed before it returns, their call fails with EBADF.
+ */
+void tinyev_co_close(int fd);
+
+/**
+ * @brief the running coroutine, NULL when called outside of one.
+ */
+void *tinyev_co_self();
+
+/**
+ * @brief suspend the calling coroutine until someone calls
+ * tinyev_co_resume() on it. Building block for custom waits.
+ */
+void tinyev_co_suspend();
+
+/**
+ * @brief switch to a suspended coroutine, returns when it suspends again
+ * or finishes.
+ *
+ * @param co    coroutine returned by tinyev_co_self().
+ */
+void tinyev_co_resume(void *co);
+
+/**
+ * @brief release pooled stacks. Coroutines that are still suspended are
+ * not touched.
+ */
+void tinyev_co_cleanup();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TINYEV_CO_H__ */
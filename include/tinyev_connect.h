@@ -0,0 +1,74 @@
+#ifndef __TINYEV_CONNECT_H__
+#define __TINYEV_CONNECT_H__
+
+#include <netdb.h>
+
+#include "tinyev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TINYEV_CONNECT_MAX_ADDRS 16     // Addresses tried per connect, the rest are ignored
+#define TINYEV_CONNECT_STAGGER 250      // Default delay before racing the next address, millisecs
+
+/**
+ * @brief called once with the user data and the result: a connected,
+ * non-blocking fd that belongs to the user and is not watched yet, with
+ * err 0. On failure fd is -1 and err is the -errno of the last address
+ * tried, -ETIMEDOUT when the timeout passed or -EHOSTUNREACH when the name
+ * did not resolve.
+ */
+typedef void (*tinyev_connect_cb)(void*, int, int);
+
+/**
+ * @brief connect without blocking the loop. Addresses are raced Happy
+ * Eyeballs style: families alternate, starting with the first one, and
+ * the next address starts when the previous one failed or after
+ * stagger_msec, whichever comes first. The first to connect wins and the
+ * others are closed.
+ *
+ * @param addrs         address list, copied, e.g. from getaddrinfo().
+ * @param timeout_msec  give up after this long, 0 for never.
+ * @param stagger_msec  head start of each address, 0 for
+ *                      TINYEV_CONNECT_STAGGER.
+ * @param cb            result callback, never called before this returns.
+ * @param data          user data to call the callback with.
+ * @param err           pointer to error as return code.
+ * @return void*        connect request, NULL and no callback if no
+ *                      address could even be tried.
+ */
+void *tinyev_connect(const struct addrinfo *addrs, int timeout_msec, int stagger_msec,
+                     tinyev_connect_cb cb, void *data, int *err);
+
+/**
+ * @brief resolve host and port on a resolver thread, then go on like
+ * tinyev_connect(). The timeout includes the name resolution.
+ *
+ * @param host          name or address.
+ * @param port          port number or service name.
+ * @param timeout_msec  give up after this long, 0 for never.
+ * @param cb            result callback, never called before this returns.
+ * @param data          user data to call the callback with.
+ * @param err           pointer to error as return code.
+ * @return void*        connect request.
+ */
+void *tinyev_connect_host(const char *host, const char *port, int timeout_msec,
+                          tinyev_connect_cb cb, void *data, int *err);
+
+/**
+ * @brief give up on a connect request, the callback is not called. Not
+ * for requests that already called it.
+ */
+void tinyev_connect_cancel(void *req);
+
+/**
+ * @brief stop the resolver threads. Call before tinyev_cleanup().
+ */
+void tinyev_connect_cleanup();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TINYEV_CONNECT_H__ */
@@ -0,0 +1,93 @@
+#ifndef __TINYEV_FILE_H__
+#define __TINYEV_FILE_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "tinyev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TINYEV_FILE_ALIGN 4096      // Buffer, offset and length alignment for O_DIRECT
+
+/* What runs the file operations. */
+enum tinyev_file_backend {
+    TINYEV_FILE_AUTO = 0,       // io_uring if the kernel allows it, threads otherwise
+    TINYEV_FILE_URING,
+    TINYEV_FILE_THREADS
+};
+
+/**
+ * @brief called from the loop with the user data and the result: bytes
+ * read or written, that may be short like with pread()/pwrite(), 0 for
+ * fsync, or -errno.
+ */
+typedef void (*tinyev_file_cb)(void*, ssize_t);
+
+/**
+ * @brief start the file I/O backend, after tinyev_init(). Operations
+ * issued during a loop iteration are submitted together once the fd
+ * callbacks are done (see tinyev_defer()), with one io_uring_enter() or
+ * one wakeup of the thread pool. Its completion fd is not counted by
+ * tinyev_waiting(), and neither are the operations in flight.
+ *
+ * @param backend   wanted backend.
+ * @return int      TINYEV_OK if all went well, TINYEV_ERR_INIT otherwise.
+ */
+int tinyev_file_init(enum tinyev_file_backend backend);
+
+/**
+ * @brief the backend in use.
+ */
+enum tinyev_file_backend tinyev_file_backend();
+
+/**
+ * @brief read len bytes at off into buf. buf must stay valid until the
+ * callback. With O_DIRECT fds use tinyev_file_buf_alloc() buffers and
+ * aligned offsets and lengths.
+ *
+ * @return int  TINYEV_OK if all went well, TINYEV_ERR_MEM or
+ *              TINYEV_ERR_INIT otherwise, the callback is not called then.
+ */
+int tinyev_file_read(int fd, void *buf, size_t len, off_t off, tinyev_file_cb cb, void *data);
+
+/**
+ * @brief write len bytes of buf at off, see tinyev_file_read().
+ */
+int tinyev_file_write(int fd, const void *buf, size_t len, off_t off, tinyev_file_cb cb, void *data);
+
+/**
+ * @brief flush the file to disk, only its data when datasync is set.
+ * Ordered only against operations that completed before it was issued.
+ */
+int tinyev_file_fsync(int fd, bool datasync, tinyev_file_cb cb, void *data);
+
+/**
+ * @brief take a TINYEV_FILE_ALIGN aligned buffer for O_DIRECT, of size
+ * rounded up to a power of 2, at least TINYEV_FILE_ALIGN. Returned
+ * buffers are kept for reuse.
+ *
+ * @param size      wanted size.
+ * @param buf       filled with the buffer.
+ * @return int      TINYEV_OK if all went well, TINYEV_ERR_MEM otherwise.
+ */
+int tinyev_file_buf_alloc(size_t size, struct tinyev_buf *buf);
+
+/**
+ * @brief give back a buffer from tinyev_file_buf_alloc().
+ */
+void tinyev_file_buf_free(struct tinyev_buf *buf);
+
+/**
+ * @brief stop the backend, operations still running are dropped without
+ * their callbacks. Call before tinyev_cleanup().
+ */
+void tinyev_file_cleanup();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TINYEV_FILE_H__ */
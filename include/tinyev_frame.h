@@ -0,0 +1,114 @@
+#ifndef __TINYEV_FRAME_H__
+#define __TINYEV_FRAME_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "tinyev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* How frames are cut out of the byte stream. */
+enum tinyev_frame_mode {
+    TINYEV_FRAME_DELIM = 0,     // Ends with a delimiter byte, e.g. '\n'
+    TINYEV_FRAME_U16,           // 2 bytes length prefix
+    TINYEV_FRAME_U32,           // 4 bytes length prefix
+    TINYEV_FRAME_FIXED          // All frames are the same size
+};
+
+/* Delimiter search implementations. */
+enum tinyev_simd {
+    TINYEV_SIMD_AUTO = 0,       // Best one this CPU has
+    TINYEV_SIMD_SCALAR,
+    TINYEV_SIMD_SSE2,
+    TINYEV_SIMD_AVX2
+};
+
+struct tinyev_frame_opts {
+    enum tinyev_frame_mode mode;
+    char delim;                 // TINYEV_FRAME_DELIM
+    bool little_endian;         // Length prefixes, network order otherwise
+    uint32_t size;              // TINYEV_FRAME_FIXED
+    uint32_t max_frame;         // Longer frames are an error, 0 for 64KB
+};
+
+/**
+ * @brief called with the user data and every complete frame, without the
+ * delimiter or the length prefix. frame points into the read buffer when
+ * the frame came in one read, and is only valid during the call. On close
+ * or error frame is NULL and len is TINYEV_EOF, -EMSGSIZE for a frame over
+ * max_frame, or any other -errno.
+ */
+typedef void (*tinyev_frame_cb)(void*, const char*, ssize_t);
+
+/**
+ * @brief create a frame decoder, fed with tinyev_frame_feed().
+ *
+ * @param opts      framing mode, copied.
+ * @param cb        user callback for every frame.
+ * @param data      user data to call the callback with.
+ * @return void*    decoder object, NULL if there's no memory.
+ */
+void *tinyev_frame_new(const struct tinyev_frame_opts *opts, tinyev_frame_cb cb, void *data);
+
+/**
+ * @brief cut frames out of buf and call the callback with them. Partial
+ * frames are kept until the rest arrives.
+ *
+ * @param fr        decoder object.
+ * @param buf       stream bytes.
+ * @param len       buf length.
+ * @return int      TINYEV_OK if all went well, TINYEV_ERR_MEM otherwise.
+ */
+int tinyev_frame_feed(void *fr, const char *buf, size_t len);
+
+/**
+ * @brief release the decoder. Safe to call from its own callback.
+ */
+void tinyev_frame_free(void *fr);
+
+/**
+ * @brief adds fd that is read by tinyev (see tinyev_add_reader()) and cut
+ * into frames that are handed to cb.
+ *
+ * @param fd        the file descriptor to read from
+ * @param opts      framing mode, copied.
+ * @param cb        user callback for every frame.
+ * @param data      user data to call the callback with.
+ * @param err       pointer to error as return code.
+ * @return void*    decoder object.
+ */
+void *tinyev_add_framed(int fd, const struct tinyev_frame_opts *opts, tinyev_frame_cb cb,
+                        void *data, int *err);
+
+/**
+ * @brief remove fd and close it, and release its decoder. Safe to call
+ * from the frame callback.
+ *
+ * @param fd        the file descriptor to remove.
+ * @param fr        decoder object returned by tinyev_add_framed().
+ */
+void tinyev_remove_framed(int fd, void *fr);
+
+/**
+ * @brief event object of a framed fd, for tinyev_set_idle() and friends.
+ */
+void *tinyev_frame_evobj(void *fr);
+
+/**
+ * @brief pick the delimiter search, levels the CPU lacks fall back to the
+ * best one it has.
+ *
+ * @param level     wanted implementation.
+ * @return enum tinyev_simd the implementation in use.
+ */
+enum tinyev_simd tinyev_frame_simd(enum tinyev_simd level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TINYEV_FRAME_H__ */
@@ -0,0 +1,53 @@
+#ifndef __TINYEV_HANDOFF_H__
+#define __TINYEV_HANDOFF_H__
+
+#include <stdint.h>
+
+#include "tinyev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Set by tinyev_handoff_send() on sockets that are listening. */
+#define TINYEV_HANDOFF_LISTENER (1 << 0)
+
+/* One fd passed to the new process, with a tag to find its state by. */
+struct tinyev_handoff_fd {
+    int fd;
+    uint64_t tag;
+    uint32_t flags;
+};
+
+/**
+ * @brief send fds to the process waiting in tinyev_handoff_recv() on the
+ * unix socket path, and wait until it got all of them. The fds stay open
+ * here, once this returns the caller removes them from its own loop with
+ * tinyev_remove_fd() and lets the rest of its connections drain. Listening
+ * sockets keep their backlog, so no pending connection is lost.
+ *
+ * @param path      unix socket the new process listens on.
+ * @param fds       fds to pass and their tags.
+ * @param n         number of fds.
+ * @return int      TINYEV_OK if all went well, TINYEV_ERR_HANDOFF otherwise.
+ */
+int tinyev_handoff_send(const char *path, const struct tinyev_handoff_fd *fds, int n);
+
+/**
+ * @brief wait up to timeout_msec for the old process to send its fds over
+ * the unix socket path. Add the received fds with tinyev_add_fd() to start
+ * serving them.
+ *
+ * @param path          unix socket to listen on, replaced if it exists.
+ * @param fds           filled with the received fds.
+ * @param max           room in fds, extra fds are closed.
+ * @param timeout_msec  how long to wait for the old process, -1 forever.
+ * @return int          number of fds received, -1 on error.
+ */
+int tinyev_handoff_recv(const char *path, struct tinyev_handoff_fd *fds, int max, int timeout_msec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TINYEV_HANDOFF_H__ */
@@ -0,0 +1,50 @@
+#ifndef __TINYEV_HIST_H__
+#define __TINYEV_HIST_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TINYEV_HIST_SUB_BITS 7      // 64 sub-buckets per power of 2, 1.6% error
+#define TINYEV_HIST_BUCKETS 3776    // Covers all of uint64_t
+
+/* Log-linear histogram in the HDR style: values below 128 are exact,
+    above that every power of 2 is split into 64 linear sub-buckets. */
+struct tinyev_hist {
+    uint64_t counts[TINYEV_HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+
+/**
+ * @brief empty the histogram.
+ */
+void tinyev_hist_reset(struct tinyev_hist *h);
+
+/**
+ * @brief count one value.
+ */
+void tinyev_hist_record(struct tinyev_hist *h, uint64_t value);
+
+/**
+ * @brief add all the counts of src to dst.
+ */
+void tinyev_hist_merge(struct tinyev_hist *dst, const struct tinyev_hist *src);
+
+/**
+ * @brief value at a percentile, the top of its bucket.
+ *
+ * @param h         histogram.
+ * @param pct       percentile, 0 to 100.
+ * @return uint64_t the value, 0 for an empty histogram.
+ */
+uint64_t tinyev_hist_percentile(const struct tinyev_hist *h, double pct);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TINYEV_HIST_H__ */
@@ -12,12 +12,21 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 
+#include <signal.h>
 #include <sys/epoll.h>
 #include <sys/fcntl.h>
+#include <sys/signalfd.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <errno.h>
 
 #include "log.h"
@@ -26,6 +35,14 @@
 /* Defines. */
 #define MAX_EVENTS 512              // Maximum amount of events to handle each time
 #define MAX_TIMERS 0x1 << 16 - 1    // Maximum timers to set at the same time
+#define IDLE_SLOTS 512              // Idle wheel size, a power of 2
+#define IDLE_RES_MSEC 64            // Idle wheel slot width
+#define SIG_BATCH 32                // Signals read from the signalfd at once
+#define ERRQ_CONTROL 512            // Control buffer for error queue reads
+#define DEFER_INIT 64               // First size of the deferred queue
+#define CORK_FLUSH (64 * 1024)      // Corked plus new bytes that are written right away
+#define CORK_MAX (4 * 1024 * 1024)  // Corked bytes kept while the fd is full
+#define RATE_DIRS 2                 // Read and write
 
 #ifdef DEBUG
 #   define DEFAULT_LOG "tinyev.log"
@@ -36,33 +53,161 @@
 struct event_data {
     event_cb cb;
     void *data;
+    /* Loop driven reads, see tinyev_add_reader(). */
+    int fd;
+    uint32_t suggested;                 // Buffer size to ask for
+    tinyev_alloc_cb alloc_cb;
+    tinyev_read_cb read_cb;
+    /* Idle timeout, see tinyev_set_idle(). */
+    struct event_data *idle_next;
+    struct event_data *idle_prev;
+    uint64_t last_active;               // Loop time of the last touch
+    event_cb idle_cb;
+    uint32_t idle_msec;                 // 0 when not tracked
+    uint32_t idle_slot;                 // Wheel slot holding it
+    /* Kernel timestamps, see tinyev_set_timestamping(). */
+    int ts_flags;
+    tinyev_tx_ts_cb tx_ts_cb;
+    struct timespec rx_ts;              // Of the last read, zero if none
+    /* Corked writes, see tinyev_write(). */
+    uint32_t ev_mask;                   // epoll events the user asked for
+    struct tinyev_buf cork;
+    size_t cork_off;                    // Already written
+    size_t cork_len;                    // End of the data
+    int cork_err;                       // -errno of a failed flush
+    bool cork_queued;                   // Flush deferred
+    bool cork_wait_out;                 // EPOLLOUT added for the rest
+    /* Rate limits, see tinyev_set_rate(). */
+    uint32_t armed;                     // epoll events registered now
+    struct rate_limit *limits;          // Per direction, NULL if none
+    struct event_data *paused_next;
+    struct event_data *paused_prev;
+    int paused;                         // Directions out of tokens, bits
+    uint64_t paused_at;                 // Loop time it got paused
+    uint64_t throttled_msec;            // Paused time before that
+    int held;                           // Directions holding loop tokens, bits
+    uint32_t held_round;                // rate_round they were held in
+    size_t held_bytes[RATE_DIRS];
+    bool internal;                      // TEV_INTERNAL, not in watched_fds or rate limited
+    struct sim_event *sim_list;         // Injected events, see tinyev_sim_inject()
+};
+
+/* Token bucket, tokens are in thousandths so a millisec of refill is
+    exact at any rate. */
+struct bucket {
+    uint64_t rate;                      // Per second, 0 for unlimited
+    int64_t max;                        // Burst, thousandths
+    int64_t tokens;                     // Below 0 after an overdraft
+    int64_t held;                       // Kept for fds rate_resume() watches again
+    uint64_t last_msec;                 // Last refill
+};
+
+struct rate_limit {
+    struct bucket bytes;
+    struct bucket ops;
 };
 
 struct timer_obj {
     struct timer_obj *next;
-    // struct timer_obj *prev;
+    struct timer_obj *prev;
     struct event_data to_user_data;
-    uint64_t to_msec;                   // Global time in millisecs
+    uint64_t to_msec;                   // Global time in millisecs, when it fires
+    uint64_t want_msec;                 // Requested fire time, before slack
     int sec;                            // Requested time, seconds
     int msec;                           // Requested time, millisecs
+    int slack;                          // Allowed lateness, millisecs
+    bool pending;                       // In timers, not fired or deleted
+};
+
+struct deferred {
+    event_cb cb;
+    void *data;
+};
+
+/* Injected fd readiness, simulated time only. */
+struct sim_event {
+    struct sim_event *next;
+    struct sim_event *prev;
+    struct sim_event *fd_next;          // The same fd's ones
+    struct sim_event *fd_prev;
+    struct event_data *fd_d;
+    uint64_t at_msec;
 };
 
 /* ==*== GLOBAL VARIABLES ==*== */
 
 /* Hold the events that occured. */
 static struct epoll_event events[MAX_EVENTS];
-/* Triggered timers list. */
+/* The ones from the current one on are still to be dispatched. */
+static int ev_cur = 0, ev_count = 0;
+/* Triggered timers list, sorted by fire time. */
 struct timer_obj *timers = NULL;
+static struct timer_obj *timers_tail = NULL;
+/* Released timers, kept for reuse so deleting one that fired already is
+    still a no-op. */
+static struct timer_obj *free_timers = NULL;
+/* Timer whose callback is running, and whether it was deleted meanwhile. */
+static struct timer_obj *running_timer = NULL;
+static bool running_deleted = false;
 /* Global fds. */
 static int epoll_fd = -1;
 /* fds and timers on. */
-static int16_t watched_fds = 0;
-static uint16_t watched_timers = 0;
+static uint32_t watched_fds = 0;
+static uint32_t watched_timers = 0;
+/* Loop counters. */
+static struct tinyev_stats stats;
+/* Time of the current loop iteration, cheap to read for tinyev_touch(). */
+static uint64_t loop_now = 0;
+/* Idle fds by the slot of their deadline at the time they were placed. The
+    extra last slot holds the slot being swept. */
+static struct event_data *idle_wheel[IDLE_SLOTS + 1];
+static uint64_t idle_tick = 0;      // Last swept slot, in IDLE_RES_MSEC units
+static uint32_t watched_idle = 0;
+/* Signals, all of them go through one signalfd. */
+static int sig_fd = -1;
+static sigset_t sig_mask;
+static struct event_data sig_handlers[_NSIG];
+static struct event_data sig_ev;
+/* Loop clock, gettimeofday() when not set. */
+static tinyev_clock_fn clock_fn = NULL;
+static void *clock_data = NULL;
+/* Simulated time and the injected events, sorted by time. */
+static uint64_t sim_now = 0;
+static struct sim_event *sim_events = NULL;
+static struct sim_event *sim_events_tail = NULL;
+/* Timer lateness. */
+static struct tinyev_hist *late_hist = NULL;
+static uint64_t last_fired_want = 0;
+/* Kernel RX to read callback delay, nanosecs. */
+static struct tinyev_hist rx_delay;
+/* Loop wide rate limits, see tinyev_set_rate(). */
+static struct rate_limit loop_rate[RATE_DIRS];
+static uint32_t rate_users = 0;     // Limits set, the fast path skips all if 0
+/* Oldest first, they get the refilled tokens first. */
+static struct event_data *paused_fds = NULL;
+static struct event_data *paused_tail = NULL;
+static uint32_t rate_round = 0;     // Bumped when the held tokens lapse
+static bool rate_holding = false;
+static void *rate_timer = NULL;
+static uint64_t rate_timer_at = 0;
+/* Deferred callbacks, queued and the ones being run. */
+static struct deferred *defer_q = NULL;
+static struct deferred *defer_run = NULL;
+static uint32_t defer_len = 0, defer_cap = 0;
+static uint32_t run_len = 0, run_cap = 0;
+
+static uint64_t sim_clock(void *unused)
+{
+    return sim_now;
+}
 
 static uint64_t time_in_millisecs(void)
 {
     struct timeval tv;
 
+    if (clock_fn)
+        return clock_fn(clock_data);
+
     gettimeofday(&tv,NULL);
     return (((long long)tv.tv_sec) * 1000) + (tv.tv_usec / 1000);
 }
@@ -86,30 +231,98 @@ static void print_list()
 }
 #endif
 
+/* Fire time within [want, want + slack]. Prefer joining a wakeup that is
+    already scheduled in that window, otherwise round down to a multiple of
+    the biggest power of 2 that fits the slack, so timers with similar
+    windows pick the same fire time. */
+static uint64_t timer_fire_time(uint64_t want, int slack)
+{
+    struct timer_obj *tmp_t = timers_tail;
+    uint64_t latest = want + slack;
+    uint64_t gran = 1, res;
+
+    if (slack <= 0) return want;
+
+    while (tmp_t && tmp_t->to_msec > latest)
+        tmp_t = tmp_t->prev;
+    if (tmp_t && tmp_t->to_msec >= want)
+        return tmp_t->to_msec;
+
+    while (gran * 2 <= (uint64_t)slack)
+        gran *= 2;
+    res = latest - latest % gran;
+
+    return res < want ? want : res;
+}
+
+/* Sorted by fire time, then by requested time. Walk from the tail since
+    new and rescheduled timers usually go last. */
 static void insert_timer(struct timer_obj *td)
 {
-    struct timer_obj *tmp_t, *tmp_p = NULL;
+    struct timer_obj *tmp_t = timers_tail;
 
-    tmp_t = timers;
-    while (tmp_t && (tmp_t->to_msec < td->to_msec)) {
-        tmp_p = tmp_t;
-        tmp_t = tmp_t->next;
+    while (tmp_t && (tmp_t->to_msec > td->to_msec ||
+                     (tmp_t->to_msec == td->to_msec && tmp_t->want_msec > td->want_msec)))
+        tmp_t = tmp_t->prev;
+
+    td->prev = tmp_t;
+    if (tmp_t) {
+        td->next = tmp_t->next;
+        tmp_t->next = td;   // Insert link
+    } else {
+        td->next = timers;
+        timers = td;        // New first
     }
 
-    if (tmp_p)
-        tmp_p->next = td;   // Insert link
+    if (td->next)
+        td->next->prev = td;
     else
-        timers = td;    // New first
-    td->next = tmp_t;
+        timers_tail = td;
+    td->pending = true;
 
 #ifdef DEBUG
     print_list();
 #endif
 }
 
-static void* do_add_timer(int sec, int msec, void* data, bool per, event_cb cb)
+static void unlink_timer(struct timer_obj *td)
 {
-    struct timer_obj *to = calloc(1, sizeof(struct timer_obj));
+    if (td->prev)
+        td->prev->next = td->next;
+    else
+        timers = td->next;
+
+    if (td->next)
+        td->next->prev = td->prev;
+    else
+        timers_tail = td->prev;
+
+    td->next = td->prev = NULL;
+    td->pending = false;
+}
+
+static struct timer_obj *timer_get()
+{
+    struct timer_obj *td = free_timers;
+
+    if (!td)
+        return calloc(1, sizeof(struct timer_obj));
+
+    free_timers = td->next;
+    memset(td, 0, sizeof(*td));
+
+    return td;
+}
+
+static void timer_put(struct timer_obj *td)
+{
+    td->next = free_timers;
+    free_timers = td;
+}
+
+static void* do_add_timer(int sec, int msec, int slack, void* data, bool per, event_cb cb)
+{
+    struct timer_obj *to = timer_get();
     uint64_t now = time_in_millisecs();
 
     if (!to) {
@@ -117,7 +330,9 @@ static void* do_add_timer(int sec, int msec, void* data, bool per, event_cb cb)
         return NULL;
     }
 
-    to->to_msec = now + msec + sec*1000;    // Total time in msecs
+    to->want_msec = now + msec + sec*1000;    // Total time in msecs
+    to->slack = slack;
+    to->to_msec = timer_fire_time(to->want_msec, slack);
     to->to_user_data.cb = cb;
     to->to_user_data.data = data;
 
@@ -137,31 +352,34 @@ static void* do_add_timer(int sec, int msec, void* data, bool per, event_cb cb)
 
 static void do_del_timer(void *timer)
 {
-    struct timer_obj *tmp_t, *tmp_p = NULL;
     struct timer_obj *td = timer;
 
     if (!td) {
         return;
     }
 
-    tmp_t = timers;
-    while (tmp_t && td != tmp_t) {
-        tmp_p = tmp_t;
-        tmp_t = tmp_t->next;
+    if (td == running_timer) {
+        /* Deleted from its own callback, check_timers() releases it. */
+        running_deleted = true;
+        return;
     }
 
-    if (!tmp_t) {
-        /* Was not found. */
-    } else {
-        tmp_p = tmp_t->next;
-        free(tmp_t);
+    /* Released already, e.g. a one-shot timer that fired. */
+    if (!td->pending) {
+        SLOG("Deleting timer %p that is not pending\n", td);
+        return;
     }
+
+    unlink_timer(td);
+    timer_put(td);
+    watched_timers--;
 }
 
 static void check_timers()
 {
     struct timer_obj *prev;
-    uint64_t now;
+    uint64_t now, last_to = 0, last_want = 0;
+    uint32_t fired = 0;
 
     if (!watched_timers) return;
 
@@ -171,24 +389,743 @@ static void check_timers()
 
     while (timers && timers->to_msec <= now) {
         /* Timeout occured. */
-        timers->to_user_data.cb(timers->to_user_data.data);
         prev = timers;
-        timers = timers->next;
+        unlink_timer(prev);
+
+        /* Slack moved it onto the fire time of another requested time,
+            that would have been a wakeup of its own. */
+        if (fired && prev->to_msec == last_to && prev->want_msec != last_want)
+            stats.wakeups_saved++;
+        last_to = prev->to_msec;
+        last_want = prev->want_msec;
+        fired++;
 
-        if (prev->sec || prev->msec) {
-            /* Periodic timer. */
-            prev->to_msec = now + prev->msec + prev->sec*1000;  // Update timeout
-            prev->next = NULL;
+        if (now > prev->want_msec) {
+            stats.timer_late_msec += now - prev->want_msec;
+            if (now - prev->want_msec > stats.timer_late_max)
+                stats.timer_late_max = now - prev->want_msec;
+        }
+        if (late_hist)
+            tinyev_hist_record(late_hist, now > prev->want_msec ? now - prev->want_msec : 0);
+        if (prev->want_msec < last_fired_want)
+            stats.timers_reordered++;
+        last_fired_want = prev->want_msec;
+
+        running_timer = prev;
+        running_deleted = false;
+        prev->to_user_data.cb(prev->to_user_data.data);
+        running_timer = NULL;
+
+        if ((prev->sec || prev->msec) && !running_deleted) {
+            /* Periodic timer, keep its own phase even when fired late. */
+            prev->want_msec += prev->msec + prev->sec*1000;  // Update timeout
+            if (prev->want_msec <= now)
+                prev->want_msec = now + prev->msec + prev->sec*1000;
+            prev->to_msec = timer_fire_time(prev->want_msec, prev->slack);
             insert_timer(prev);
         } else {
             SLOG("Released timer %p\n", prev);
-            free(prev);
+            timer_put(prev);
             watched_timers--;
 #ifdef DEBUG
             print_list();
 #endif
         }
     }
+
+    if (fired) {
+        stats.timer_wakeups++;
+        stats.timers_fired += fired;
+    }
+}
+
+static void idle_link(struct event_data *fd_d, uint32_t slot)
+{
+    fd_d->idle_slot = slot;
+    fd_d->idle_prev = NULL;
+    fd_d->idle_next = idle_wheel[slot];
+    if (fd_d->idle_next)
+        fd_d->idle_next->idle_prev = fd_d;
+    idle_wheel[slot] = fd_d;
+}
+
+static void idle_unlink(struct event_data *fd_d)
+{
+    if (fd_d->idle_prev)
+        fd_d->idle_prev->idle_next = fd_d->idle_next;
+    else
+        idle_wheel[fd_d->idle_slot] = fd_d->idle_next;
+
+    if (fd_d->idle_next)
+        fd_d->idle_next->idle_prev = fd_d->idle_prev;
+
+    fd_d->idle_next = fd_d->idle_prev = NULL;
+}
+
+static void idle_place(struct event_data *fd_d)
+{
+    uint64_t deadline = fd_d->last_active + fd_d->idle_msec;
+
+    idle_link(fd_d, (deadline / IDLE_RES_MSEC) & (IDLE_SLOTS - 1));
+}
+
+/* Sweep every slot that ended by now. Touches only update last_active, so
+    an fd found in a slot may have been active since and is just moved to
+    the slot of its new deadline. */
+static void check_idle(uint64_t now)
+{
+    struct event_data *fd_d;
+    uint64_t now_tick = now / IDLE_RES_MSEC;
+    uint32_t slot, swept = 0;
+
+    if (!watched_idle) {
+        idle_tick = now_tick - 1;
+        return;
+    }
+
+    while (idle_tick + 1 < now_tick && swept++ < IDLE_SLOTS) {
+        idle_tick++;
+        slot = idle_tick & (IDLE_SLOTS - 1);
+
+        /* Move the slot aside, callbacks may remove any fd meanwhile. */
+        idle_wheel[IDLE_SLOTS] = idle_wheel[slot];
+        idle_wheel[slot] = NULL;
+        for (fd_d = idle_wheel[IDLE_SLOTS]; fd_d; fd_d = fd_d->idle_next)
+            fd_d->idle_slot = IDLE_SLOTS;
+
+        while ((fd_d = idle_wheel[IDLE_SLOTS])) {
+            idle_unlink(fd_d);
+            if (fd_d->last_active + fd_d->idle_msec > now) {
+                idle_place(fd_d);
+                continue;
+            }
+
+            /* Timed out, it's up to the user to remove the fd. */
+            SLOG("Idle timeout on %p\n", fd_d);
+            fd_d->idle_msec = 0;
+            watched_idle--;
+            stats.idle_timeouts++;
+            fd_d->idle_cb(fd_d->data);
+        }
+    }
+
+    if (idle_tick + 1 < now_tick)
+        idle_tick = now_tick - 1;
+}
+
+/* Poll timeout that wakes up for the next timer or the end of the next
+    busy idle slot, bounded by the user's. */
+static int next_timeout(int msec)
+{
+    uint64_t now, wake = UINT64_MAX;
+    uint64_t tick;
+
+    if (defer_len) return 0;
+    if (!timers && !watched_idle && !sim_events) return msec;
+
+    now = time_in_millisecs();
+    if (timers)
+        wake = timers->to_msec;
+    if (sim_events && sim_events->at_msec < wake)
+        wake = sim_events->at_msec;
+
+    for (tick = idle_tick + 1; watched_idle && tick <= idle_tick + IDLE_SLOTS; tick++) {
+        if (idle_wheel[tick & (IDLE_SLOTS - 1)]) {
+            if ((tick + 1) * IDLE_RES_MSEC < wake)
+                wake = (tick + 1) * IDLE_RES_MSEC;
+            break;
+        }
+    }
+
+    if (wake <= now) return 0;
+    if (msec < 0 || wake - now < (uint64_t)msec)
+        return (int)(wake - now);
+
+    return msec;
+}
+
+/* Drain every pending signal on each wakeup. */
+static void dispatch_signals(void *unused)
+{
+    struct signalfd_siginfo info[SIG_BATCH];
+    struct event_data *sig_d;
+    ssize_t bytes;
+    int i;
+
+    while ((bytes = read(sig_fd, info, sizeof(info))) > 0) {
+        for (i = 0; i < bytes / (ssize_t)sizeof(info[0]); i++) {
+            sig_d = &sig_handlers[info[i].ssi_signo];
+            stats.signals++;
+            /* Could have been removed by an earlier handler in the batch. */
+            if (sig_d->cb)
+                sig_d->cb(sig_d->data);
+        }
+        if (bytes < (ssize_t)sizeof(info)) break;
+    }
+}
+
+static void cork_flush(void *arg);
+
+/* Register what the user asked for, minus what's paused. */
+static void apply_events(struct event_data *fd_d)
+{
+    struct epoll_event ev;
+    uint32_t events = fd_d->ev_mask;
+
+    if (fd_d->cork_wait_out)
+        events |= EPOLLOUT;
+    if (fd_d->paused & (1 << TINYEV_RATE_READ))
+        events &= ~(EPOLLIN | EPOLLPRI);
+    if (fd_d->paused & (1 << TINYEV_RATE_WRITE))
+        events &= ~EPOLLOUT;
+    if (events == fd_d->armed) return;
+
+    ev.events = events;
+    ev.data.ptr = fd_d;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd_d->fd, &ev);
+    fd_d->armed = events;
+}
+
+static void bucket_set(struct bucket *b, uint64_t rate, uint64_t burst)
+{
+    if (!burst)
+        burst = rate / 10 ? rate / 10 : 1;
+
+    b->rate = rate;
+    b->max = rate ? burst * 1000 : 0;
+    b->tokens = b->max;
+    b->held = 0;
+    b->last_msec = loop_now;
+}
+
+/* Millisecs until the bucket has tokens nobody holds, 0 if it has some now. */
+static uint64_t bucket_wait(struct bucket *b, uint64_t now)
+{
+    if (!b->rate) return 0;
+
+    if (now > b->last_msec) {
+        b->tokens += (now - b->last_msec) * b->rate;
+        if (b->tokens > b->max)
+            b->tokens = b->max;
+        b->last_msec = now;
+    }
+    if (b->tokens > b->held) return 0;
+
+    return (uint64_t)(b->held - b->tokens) / b->rate + 1;
+}
+
+static int limit_set(struct rate_limit *l)
+{
+    return l->bytes.rate || l->ops.rate;
+}
+
+static uint64_t limit_wait(struct rate_limit *l, uint64_t now)
+{
+    uint64_t bytes = bucket_wait(&l->bytes, now);
+    uint64_t ops = bucket_wait(&l->ops, now);
+
+    return bytes > ops ? bytes : ops;
+}
+
+/* Give back what rate_hold() kept for fd_d. */
+static void rate_release(struct event_data *fd_d, int dir)
+{
+    struct rate_limit *l = &loop_rate[dir];
+
+    if (!(fd_d->held & (1 << dir))) return;
+
+    fd_d->held &= ~(1 << dir);
+    if (fd_d->held_round != rate_round) return;
+
+    l->bytes.held -= (int64_t)fd_d->held_bytes[dir] * 1000;
+    if (l->ops.rate)
+        l->ops.held -= 1000;
+}
+
+/* Called by fd_d before it reads or writes, so what was held for it is
+    its own again. */
+static uint64_t rate_wait(struct event_data *fd_d, int dir, uint64_t now)
+{
+    uint64_t wait, fd_wait;
+
+    if (fd_d->held)
+        rate_release(fd_d, dir);
+    wait = limit_wait(&loop_rate[dir], now);
+
+    if (fd_d->limits) {
+        fd_wait = limit_wait(&fd_d->limits[dir], now);
+        if (fd_wait > wait)
+            wait = fd_wait;
+    }
+
+    return wait;
+}
+
+static void limit_take(struct rate_limit *l, size_t bytes, uint32_t ops)
+{
+    if (l->bytes.rate)
+        l->bytes.tokens -= (int64_t)bytes * 1000;
+    if (l->ops.rate)
+        l->ops.tokens -= (int64_t)ops * 1000;
+}
+
+static size_t bucket_cap(struct bucket *b, size_t len)
+{
+    uint64_t avail;
+
+    if (!b->rate) return len;
+
+    avail = b->tokens - b->held > 1000 ? (uint64_t)(b->tokens - b->held) / 1000 : 1;
+
+    return len > avail ? avail : len;
+}
+
+/* Read or write no more than the byte tokens there are, so one big op
+    doesn't leave everyone sharing the loop's bucket waiting. */
+static size_t rate_cap(struct event_data *fd_d, int dir, size_t len)
+{
+    len = bucket_cap(&loop_rate[dir].bytes, len);
+    if (fd_d->limits)
+        len = bucket_cap(&fd_d->limits[dir].bytes, len);
+
+    return len;
+}
+
+static void rate_resume(void *unused);
+
+/* In wait millisecs of the timers' clock, unless it's armed sooner. */
+static void rate_arm(uint64_t now, uint64_t wait)
+{
+    if (rate_timer && rate_timer_at <= now + wait) return;
+
+    if (rate_timer)
+        do_del_timer(rate_timer);
+    rate_timer = do_add_timer(0, wait, 0, NULL, false, rate_resume);
+    rate_timer_at = now + wait;
+}
+
+/* Stop watching dir until the buckets refill. */
+static void rate_pause(struct event_data *fd_d, int dir, uint64_t wait)
+{
+    if (fd_d->paused & (1 << dir)) return;
+
+    if (!fd_d->paused) {
+        fd_d->paused_next = NULL;
+        fd_d->paused_prev = paused_tail;
+        if (paused_tail)
+            paused_tail->paused_next = fd_d;
+        else
+            paused_fds = fd_d;
+        paused_tail = fd_d;
+        fd_d->paused_at = loop_now;
+    }
+    fd_d->paused |= 1 << dir;
+    stats.throttles++;
+
+    apply_events(fd_d);
+    rate_arm(time_in_millisecs(), wait);
+}
+
+/* Off the paused list, the directions are cleared by the caller. */
+static void rate_unlink(struct event_data *fd_d, uint64_t now)
+{
+    uint64_t paused = now > fd_d->paused_at ? now - fd_d->paused_at : 0;
+
+    if (fd_d->paused_prev)
+        fd_d->paused_prev->paused_next = fd_d->paused_next;
+    else
+        paused_fds = fd_d->paused_next;
+    if (fd_d->paused_next)
+        fd_d->paused_next->paused_prev = fd_d->paused_prev;
+    else
+        paused_tail = fd_d->paused_prev;
+
+    fd_d->throttled_msec += paused;
+    stats.throttled_msec += paused;
+}
+
+/* Take from the fd's and the loop's buckets, pause dir once overdrawn. */
+static void rate_charge(struct event_data *fd_d, int dir, size_t bytes, uint32_t ops)
+{
+    uint64_t wait;
+
+    limit_take(&loop_rate[dir], bytes, ops);
+    if (fd_d->limits)
+        limit_take(&fd_d->limits[dir], bytes, ops);
+
+    wait = rate_wait(fd_d, dir, loop_now);
+    if (wait)
+        rate_pause(fd_d, dir, wait);
+}
+
+/* One op in dir if there are tokens for it. */
+static bool rate_take(struct event_data *fd_d, int dir)
+{
+    uint64_t wait = rate_wait(fd_d, dir, loop_now);
+
+    if (wait) {
+        rate_pause(fd_d, dir, wait);
+        return false;
+    }
+    rate_charge(fd_d, dir, 0, 1);
+
+    return true;
+}
+
+/* Whether the event may reach the fd callback. Errors and hangups always
+    do, they can't be unwatched and would wake the loop all the time. */
+static bool rate_admit(struct event_data *fd_d, uint32_t events)
+{
+    bool ok = false;
+
+    if (events & (EPOLLERR | EPOLLHUP)) return true;
+
+    if (events & (EPOLLIN | EPOLLPRI))
+        ok = rate_take(fd_d, TINYEV_RATE_READ);
+    if ((events & EPOLLOUT) && (fd_d->ev_mask & EPOLLOUT) && rate_take(fd_d, TINYEV_RATE_WRITE))
+        ok = true;
+
+    return ok;
+}
+
+/* Keep one op and up to share bytes of the loop's tokens for fd_d until it
+    gets to use them, whatever order epoll reports it in. The fds after it in
+    the paused list only see what's left. */
+static void rate_hold(struct event_data *fd_d, int dir, size_t share)
+{
+    struct rate_limit *l = &loop_rate[dir];
+    size_t bytes = 0;
+    int64_t avail;
+
+    if (l->bytes.rate) {
+        bytes = dir == TINYEV_RATE_READ ? fd_d->suggested : fd_d->cork_len - fd_d->cork_off;
+        if (bytes > share)
+            bytes = share;
+        avail = (l->bytes.tokens - l->bytes.held) / 1000;
+        if ((int64_t)bytes > avail)
+            bytes = avail > 0 ? avail : 0;
+        l->bytes.held += (int64_t)bytes * 1000;
+    }
+    if (l->ops.rate)
+        l->ops.held += 1000;
+
+    fd_d->held |= 1 << dir;
+    fd_d->held_round = rate_round;
+    fd_d->held_bytes[dir] = bytes;
+    rate_holding = true;
+}
+
+/* What wasn't used by the end of a batch is everyone's again. */
+static void rate_lapse()
+{
+    int dir;
+
+    for (dir = 0; dir < RATE_DIRS; dir++)
+        loop_rate[dir].bytes.held = loop_rate[dir].ops.held = 0;
+    rate_round++;
+    rate_holding = false;
+}
+
+/* Watch again what has tokens, oldest first, each holding its share so the
+    ones after it wait if that's all there is. Corked data goes out then. */
+static void rate_resume(void *unused)
+{
+    struct event_data *fd_d, *next;
+    uint64_t now = time_in_millisecs(), wait, soonest = 0;
+    size_t share[RATE_DIRS];
+    int dir, paused, count[RATE_DIRS] = {0};
+    int64_t avail;
+
+    rate_timer = NULL;
+
+    /* An even split of the loop's bytes, so one big reader first in the
+        list doesn't hold them all. */
+    for (fd_d = paused_fds; fd_d; fd_d = fd_d->paused_next) {
+        for (dir = 0; dir < RATE_DIRS; dir++)
+            count[dir] += !!(fd_d->paused & (1 << dir));
+    }
+    for (dir = 0; dir < RATE_DIRS; dir++) {
+        limit_wait(&loop_rate[dir], now);
+        avail = (loop_rate[dir].bytes.tokens - loop_rate[dir].bytes.held) / 1000;
+        share[dir] = count[dir] && avail > count[dir] ? avail / count[dir] : 1;
+    }
+
+    for (fd_d = paused_fds; fd_d; fd_d = next) {
+        next = fd_d->paused_next;
+
+        paused = fd_d->paused;
+
+        for (dir = 0; dir < RATE_DIRS; dir++) {
+            if (!(paused & (1 << dir))) continue;
+
+            wait = rate_wait(fd_d, dir, now);
+            if (wait) {
+                if (!soonest || wait < soonest)
+                    soonest = wait;
+                continue;
+            }
+            paused &= ~(1 << dir);
+            /* Alone in the list it has nobody to go before. */
+            if (count[dir] > 1)
+                rate_hold(fd_d, dir, share[dir]);
+            if (dir == TINYEV_RATE_WRITE && fd_d->cork_len > fd_d->cork_off && !fd_d->cork_queued &&
+                !tinyev_defer(cork_flush, fd_d))
+                fd_d->cork_queued = true;
+        }
+
+        if (!paused)
+            rate_unlink(fd_d, now);
+        fd_d->paused = paused;
+        apply_events(fd_d);
+    }
+
+    if (soonest)
+        rate_arm(now, soonest);
+}
+
+static void record_rx_delay(const struct timespec *ts)
+{
+    struct timespec now;
+    int64_t delay;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    delay = (int64_t)(now.tv_sec - ts->tv_sec) * 1000000000 + (now.tv_nsec - ts->tv_nsec);
+    stats.rx_stamped++;
+    tinyev_hist_record(&rx_delay, delay > 0 ? delay : 0);
+}
+
+/* Take a buffer only now that there's something to read. */
+static void do_read(struct event_data *fd_d)
+{
+    struct tinyev_buf buf = {0};
+    size_t len;
+    ssize_t bytes;
+
+    if (fd_d->alloc_cb)
+        fd_d->alloc_cb(fd_d->data, fd_d->suggested, &buf);
+    else
+        tinyev_buf_alloc(fd_d->suggested, &buf);
+
+    if (!buf.base) {
+        fd_d->read_cb(fd_d->data, -ENOBUFS, &buf);
+        return;
+    }
+
+    len = rate_users ? rate_cap(fd_d, TINYEV_RATE_READ, buf.len) : buf.len;
+    if (fd_d->ts_flags & TINYEV_TS_RX) {
+        bytes = tinyev_recv_ts(fd_d->fd, buf.base, len, &fd_d->rx_ts);
+        if (bytes > 0 && fd_d->rx_ts.tv_sec)
+            record_rx_delay(&fd_d->rx_ts);
+    } else {
+        bytes = read(fd_d->fd, buf.base, len);
+    }
+    if (bytes > 0 && rate_users)
+        rate_charge(fd_d, TINYEV_RATE_READ, bytes, 0);
+    if (bytes == 0)
+        bytes = TINYEV_EOF;
+    else if (bytes < 0)
+        bytes = (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -errno;
+
+    fd_d->read_cb(fd_d->data, bytes, &buf);
+}
+
+/* Hand the TX timestamps on the error queue to the user. Returns how many
+    messages were read. */
+static int drain_tx_stamps(struct event_data *fd_d)
+{
+    char control[ERRQ_CONTROL];
+    struct sock_extended_err *serr;
+    struct timespec *ts;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    int n = 0;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd_d->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+        n++;
+
+        ts = NULL;
+        serr = NULL;
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+                ts = &((struct scm_timestamping *)CMSG_DATA(cm))->ts[0];
+            else if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                     (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        }
+
+        if (ts && serr && serr->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+            stats.tx_stamps++;
+            if (fd_d->tx_ts_cb)
+                fd_d->tx_ts_cb(fd_d->data, serr->ee_data, ts);
+            /* Removed by the callback. */
+            if (events[ev_cur].data.ptr != fd_d)
+                break;
+        }
+    }
+
+    return n;
+}
+
+static void cork_release(struct event_data *fd_d)
+{
+    if (fd_d->cork.base)
+        tinyev_buf_free(&fd_d->cork);
+    fd_d->cork.base = NULL;
+    fd_d->cork.len = 0;
+    fd_d->cork_off = fd_d->cork_len = 0;
+}
+
+static void cork_wait_out(struct event_data *fd_d, bool on)
+{
+    if (fd_d->cork_wait_out == on) return;
+
+    fd_d->cork_wait_out = on;
+    apply_events(fd_d);
+}
+
+/* One write for everything corked so far, what doesn't fit waits for
+    EPOLLOUT, what is over the rate limit waits for tokens. The buffer goes
+    back to the pool once it's all out. */
+static void do_cork_flush(struct event_data *fd_d, bool limited)
+{
+    ssize_t bytes;
+    size_t len;
+    uint64_t wait;
+
+    fd_d->cork_queued = false;
+
+    while (fd_d->cork_off < fd_d->cork_len) {
+        len = fd_d->cork_len - fd_d->cork_off;
+        if (limited && rate_users) {
+            wait = rate_wait(fd_d, TINYEV_RATE_WRITE, loop_now);
+            if (wait) {
+                rate_pause(fd_d, TINYEV_RATE_WRITE, wait);
+                return;
+            }
+            len = rate_cap(fd_d, TINYEV_RATE_WRITE, len);
+        }
+        bytes = write(fd_d->fd, fd_d->cork.base + fd_d->cork_off, len);
+        stats.write_syscalls++;
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                cork_wait_out(fd_d, true);
+                return;
+            }
+            SLOG("Corked write failed, errno %d", errno);
+            fd_d->cork_err = -errno;
+            break;
+        }
+        fd_d->cork_off += bytes;
+        if (limited && rate_users)
+            rate_charge(fd_d, TINYEV_RATE_WRITE, bytes, 1);
+    }
+
+    cork_release(fd_d);
+    cork_wait_out(fd_d, false);
+}
+
+static void cork_flush(void *arg)
+{
+    do_cork_flush(arg, true);
+}
+
+/* What's corked, then buf, in writev() calls until the socket or the rate
+    tokens run out. Returns how much of buf went out, or -errno. */
+static ssize_t write_through(struct event_data *fd_d, const char *buf, size_t len)
+{
+    struct iovec iov[2];
+    size_t pending, done = 0, cap;
+    ssize_t bytes;
+    uint64_t wait;
+
+    while ((pending = fd_d->cork_len - fd_d->cork_off) || done < len) {
+        iov[0].iov_base = fd_d->cork.base + fd_d->cork_off;
+        iov[0].iov_len = pending;
+        iov[1].iov_base = (char *)buf + done;
+        iov[1].iov_len = len - done;
+
+        if (rate_users) {
+            wait = rate_wait(fd_d, TINYEV_RATE_WRITE, loop_now);
+            if (wait) {
+                rate_pause(fd_d, TINYEV_RATE_WRITE, wait);
+                break;
+            }
+            cap = rate_cap(fd_d, TINYEV_RATE_WRITE, pending + len - done);
+            if (cap <= pending) {
+                iov[0].iov_len = cap;
+                iov[1].iov_len = 0;
+            } else {
+                iov[1].iov_len = cap - pending;
+            }
+        }
+
+        bytes = writev(fd_d->fd, iov, 2);
+        stats.write_syscalls++;
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -errno;
+        }
+        if (rate_users)
+            rate_charge(fd_d, TINYEV_RATE_WRITE, bytes, 1);
+
+        if ((size_t)bytes <= pending) {
+            fd_d->cork_off += bytes;
+        } else {
+            fd_d->cork_off = fd_d->cork_len;
+            done += bytes - pending;
+        }
+    }
+
+    if (fd_d->cork_off == fd_d->cork_len)
+        cork_release(fd_d);
+
+    return done;
+}
+
+/* Run what was deferred until now, what these defer runs next time. */
+static void run_deferred()
+{
+    struct deferred *tmp_d;
+    uint32_t tmp_cap, i;
+
+    if (!defer_len) return;
+
+    tmp_d = defer_run;
+    defer_run = defer_q;
+    defer_q = tmp_d;
+    tmp_cap = run_cap;
+    run_cap = defer_cap;
+    defer_cap = tmp_cap;
+    run_len = defer_len;
+    defer_len = 0;
+
+    for (i = 0; i < run_len; i++) {
+        /* Cleared when its fd was removed meanwhile. */
+        if (defer_run[i].cb)
+            defer_run[i].cb(defer_run[i].data);
+    }
+    run_len = 0;
+}
+
+static void drop_deferred(event_cb cb, void *data)
+{
+    uint32_t i;
+
+    for (i = 0; i < defer_len; i++) {
+        if (defer_q[i].cb == cb && defer_q[i].data == data)
+            defer_q[i].cb = NULL;
+    }
+    for (i = 0; i < run_len; i++) {
+        if (defer_run[i].cb == cb && defer_run[i].data == data)
+            defer_run[i].cb = NULL;
+    }
 }
 
 static int tev_to_events(int events)
@@ -198,42 +1135,147 @@ static int tev_to_events(int events)
     if (events & TEV_RECV) res |= EPOLLIN;
     if (events & TEV_SEND) res |= EPOLLOUT;
     if (events & TEV_ERROR) res |= EPOLLERR;
+    if (events & TEV_EDGE) res |= EPOLLET;
 
     return res;
 }
 
+static void dispatch_fd(struct event_data *fd_d)
+{
+    /* Call the user. */
+    if (fd_d->read_cb)
+        do_read(fd_d);
+    else
+        fd_d->cb(fd_d->data);
+}
+
+static void sim_unlink(struct sim_event *se)
+{
+    if (se->prev)
+        se->prev->next = se->next;
+    else
+        sim_events = se->next;
+
+    if (se->next)
+        se->next->prev = se->prev;
+    else
+        sim_events_tail = se->prev;
+
+    if (se->fd_prev)
+        se->fd_prev->fd_next = se->fd_next;
+    else
+        se->fd_d->sim_list = se->fd_next;
+    if (se->fd_next)
+        se->fd_next->fd_prev = se->fd_prev;
+}
+
+/* Injected events that are due, after the real ones like a poll would. */
+static void dispatch_sim_events()
+{
+    struct sim_event *se;
+    struct event_data *fd_d;
+
+    while ((se = sim_events) && se->at_msec <= loop_now) {
+        sim_unlink(se);
+        fd_d = se->fd_d;
+        free(se);
+        dispatch_fd(fd_d);
+    }
+}
+
 int tinyev_poll(int msec)
 {
     struct event_data *fd_d;
-    int nfds, i;
+    uint64_t start, waited;
+    int nfds, i, timeout;
 
-    nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, msec);
+    timeout = next_timeout(msec);
+    if (clock_fn == sim_clock) {
+        nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 0);
+        /* Nothing real to do, jump to whatever comes next. */
+        if (nfds == 0 && timeout > 0)
+            sim_now += timeout;
+    } else {
+        /* A signal handled outside of tinyev is not an error. Wait only
+            for what's left, so a stream of signals can't hold timers off. */
+        start = time_in_millisecs();
+        while ((nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout)) == -1 && errno == EINTR) {
+            waited = time_in_millisecs() - start;
+            if (msec < 0)
+                timeout = next_timeout(msec);
+            else
+                timeout = next_timeout(waited < (uint64_t)msec ? msec - (int)waited : 0);
+        }
+    }
     if (nfds == -1) {
         SLOG("epoll_wait\n");
         return TINYEV_ERR_POLL;
     }
+    stats.wakeups++;
+    loop_now = time_in_millisecs();
 
     /* First check messages/traffic. */
+    ev_count = nfds;
     for (i = 0; i < nfds; i++) {
+        ev_cur = i;
         fd_d = (struct event_data *)events[i].data.ptr;
-        /* Call the user. */
-        fd_d->cb(fd_d->data);
+        /* Removed by an earlier callback of this batch. */
+        if (!fd_d)
+            continue;
+        /* Woken up only for timestamps, nothing for the fd callback. */
+        if ((fd_d->ts_flags & TINYEV_TS_TX) && (events[i].events & EPOLLERR) &&
+            drain_tx_stamps(fd_d) && !(events[i].events & ~EPOLLERR))
+            continue;
+        /* Or by its own TX stamp callback. */
+        if (!events[i].data.ptr)
+            continue;
+        /* Room for the rest of the corked data, the user may not care. */
+        if (fd_d->cork_wait_out && (events[i].events & EPOLLOUT)) {
+            cork_flush(fd_d);
+            if (!(events[i].events & (fd_d->ev_mask | EPOLLERR | EPOLLHUP) & ~EPOLLOUT) &&
+                !(fd_d->ev_mask & EPOLLOUT))
+                continue;
+        }
+        /* Out of rate tokens, unwatched until they refill. The library's
+            own fds are never limited. */
+        if (rate_users && !fd_d->internal && !rate_admit(fd_d, events[i].events))
+            continue;
+        dispatch_fd(fd_d);
     }
+    ev_count = 0;
+    if (sim_events)
+        dispatch_sim_events();
+    run_deferred();
+    if (rate_holding)
+        rate_lapse();
 
     /* Check timers. */
     check_timers();
+    check_idle(loop_now);
+    /* Writes corked by timer and idle callbacks. */
+    run_deferred();
 
     return TINYEV_ERR_OK;
 }
 
 void* tinyev_add_timer(int sec, int msec, void* data, event_cb cb)
 {
-    return do_add_timer(sec, msec, data, false, cb);
+    return do_add_timer(sec, msec, 0, data, false, cb);
 }
 
 void* tinyev_add_periodic(int sec, int msec, void* data, event_cb cb)
 {
-    return do_add_timer(sec, msec, data, true, cb);
+    return do_add_timer(sec, msec, 0, data, true, cb);
+}
+
+void* tinyev_add_timer_slack(int sec, int msec, int slack, void* data, event_cb cb)
+{
+    return do_add_timer(sec, msec, slack, data, false, cb);
+}
+
+void* tinyev_add_periodic_slack(int sec, int msec, int slack, void* data, event_cb cb)
+{
+    return do_add_timer(sec, msec, slack, data, true, cb);
 }
 
 void tinyev_del_timer(void* tobj)
@@ -241,12 +1283,18 @@ void tinyev_del_timer(void* tobj)
     do_del_timer(tobj);
 }
 
+void tinyev_timer_set_data(void *tobj, void *data)
+{
+    if (tobj)
+        ((struct timer_obj *)tobj)->to_user_data.data = data;
+}
+
 void *tinyev_add_fd(int fd, void* data, event_cb cb, enum tinyev_events events, int *err)
 {
     struct epoll_event ev;
     struct event_data *fd_d;
 
-    fd_d = malloc(sizeof(struct event_data));
+    fd_d = calloc(1, sizeof(struct event_data));
     if (!fd_d) {
         *err = TINYEV_ERR_MEM;
         return NULL;
@@ -254,39 +1302,497 @@ void *tinyev_add_fd(int fd, void* data, event_cb cb, enum tinyev_events events,
 
     fd_d->cb = cb;
     fd_d->data = data;
+    fd_d->fd = fd;
 
     /* Set the fd to be non-blocking. */
     if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
         SLOG("ERROR setting up non-blocking socket");
+        free(fd_d);
         *err = TINYEV_ERR_ADD;
         return NULL;
     }
 
     ev.events = tev_to_events(events);
+    fd_d->ev_mask = ev.events;
+    fd_d->armed = ev.events;
+    fd_d->internal = events & TEV_INTERNAL;
     ev.data.fd = fd;
     ev.data.ptr = fd_d;
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
         SLOG("epoll_ctl error add");
+        free(fd_d);
         *err = TINYEV_ERR_ADD;
         return NULL;
     }
 
-    watched_fds++;
+    if (!fd_d->internal)
+        watched_fds++;
     *err = TINYEV_ERR_OK;
     
     return fd_d;
 }
 
+void *tinyev_add_reader(int fd, void* data, size_t suggested, tinyev_alloc_cb alloc_cb,
+                        tinyev_read_cb read_cb, int *err)
+{
+    struct event_data *fd_d;
+
+    fd_d = tinyev_add_fd(fd, data, NULL, TEV_RECV | TEV_CLOSE | TEV_ERROR, err);
+    if (!fd_d) return NULL;
+
+    fd_d->fd = fd;
+    fd_d->suggested = suggested ? suggested : TINYEV_READ_SIZE;
+    fd_d->alloc_cb = alloc_cb;
+    fd_d->read_cb = read_cb;
+
+    return fd_d;
+}
+
+static void do_remove_fd(int fd, struct event_data *fd_d, bool do_close)
+{
+    struct sim_event *se;
+    int i;
+
+    /* Whatever was corked goes out if it can, without waiting. */
+    if (fd_d->cork_queued)
+        drop_deferred(cork_flush, fd_d);
+    if (fd_d->cork_len > fd_d->cork_off)
+        do_cork_flush(fd_d, false);
+    cork_release(fd_d);
+
+    if (fd_d->paused)
+        rate_unlink(fd_d, loop_now);
+    if (fd_d->held) {
+        rate_release(fd_d, TINYEV_RATE_READ);
+        rate_release(fd_d, TINYEV_RATE_WRITE);
+    }
+    if (fd_d->limits) {
+        rate_users -= limit_set(&fd_d->limits[TINYEV_RATE_READ]) +
+                      limit_set(&fd_d->limits[TINYEV_RATE_WRITE]);
+        free(fd_d->limits);
+    }
+
+    if (fd_d->idle_msec) {
+        idle_unlink(fd_d);
+        watched_idle--;
+    }
+
+    while ((se = fd_d->sim_list)) {
+        sim_unlink(se);
+        free(se);
+    }
+
+    /* Removed from a callback, it may still be due later in this batch. */
+    for (i = ev_cur; i < ev_count; i++) {
+        if (events[i].data.ptr == fd_d)
+            events[i].data.ptr = NULL;
+    }
+
+    /* close() alone keeps it watched while another process (handoff, fork)
+        still holds the same socket. */
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    if (do_close)
+        close(fd);
+    if (watched_fds && !fd_d->internal)
+        watched_fds--;
+    free(fd_d);
+}
+
 void tinyev_remove_fd(int fd, void *evobj)
+{
+    if (!evobj) return;
+
+    do_remove_fd(fd, evobj, true);
+}
+
+void tinyev_detach_fd(int fd, void *evobj)
+{
+    if (!evobj) return;
+
+    do_remove_fd(fd, evobj, false);
+}
+
+int tinyev_defer(event_cb cb, void *data)
+{
+    struct deferred *tmp_d;
+    uint32_t cap;
+
+    if (defer_len == defer_cap) {
+        cap = defer_cap ? defer_cap * 2 : DEFER_INIT;
+        tmp_d = realloc(defer_q, cap * sizeof(struct deferred));
+        if (!tmp_d) {
+            SLOG("Failed growing the deferred queue");
+            return TINYEV_ERR_MEM;
+        }
+        defer_q = tmp_d;
+        defer_cap = cap;
+    }
+
+    defer_q[defer_len].cb = cb;
+    defer_q[defer_len].data = data;
+    defer_len++;
+
+    return TINYEV_ERR_OK;
+}
+
+ssize_t tinyev_write(void *evobj, const void *buf, size_t len)
 {
     struct event_data *fd_d = evobj;
+    struct tinyev_buf bigger;
+    size_t pending, total = len;
+    ssize_t sent;
+    int err;
 
-    if (!fd_d) return;
+    if (!fd_d) return -EBADF;
 
-    close(fd); // Will remove fd from epoll watch list
-    free(fd_d);
-    if (watched_fds)
-        watched_fds--;
+    if (fd_d->cork_err) {
+        err = fd_d->cork_err;
+        fd_d->cork_err = 0;
+        return err;
+    }
+
+    stats.writes_corked++;
+
+    /* Big enough to be worth a write of its own: what's corked and buf go
+        out together without copying buf, only what's left is corked. */
+    if (fd_d->cork_len - fd_d->cork_off + len > CORK_FLUSH && !fd_d->cork_wait_out &&
+        !(fd_d->paused & (1 << TINYEV_RATE_WRITE))) {
+        if (fd_d->cork_queued) {
+            drop_deferred(cork_flush, fd_d);
+            fd_d->cork_queued = false;
+        }
+        sent = write_through(fd_d, buf, len);
+        if (sent < 0) {
+            SLOG("Write failed, errno %d", (int)-sent);
+            cork_release(fd_d);
+            return sent;
+        }
+        buf = (const char *)buf + sent;
+        len -= sent;
+        if (!len) return total;
+    }
+
+    pending = fd_d->cork_len - fd_d->cork_off;
+    if (pending + len > CORK_MAX) return total - len ? (ssize_t)(total - len) : -ENOBUFS;
+
+    if (fd_d->cork_len + len > fd_d->cork.len) {
+        /* Move what's left to the front of a buffer that fits it all. */
+        if (pending + len > fd_d->cork.len) {
+            if (tinyev_buf_alloc(pending + len, &bigger))
+                return total - len ? (ssize_t)(total - len) : -ENOBUFS;
+        } else {
+            bigger = fd_d->cork;
+        }
+        if (pending)
+            memmove(bigger.base, fd_d->cork.base + fd_d->cork_off, pending);
+        if (bigger.base != fd_d->cork.base && fd_d->cork.base)
+            tinyev_buf_free(&fd_d->cork);
+        fd_d->cork = bigger;
+        fd_d->cork_off = 0;
+        fd_d->cork_len = pending;
+    }
+
+    memcpy(fd_d->cork.base + fd_d->cork_len, buf, len);
+    fd_d->cork_len += len;
+
+    /* Still waiting for EPOLLOUT or for tokens, it flushes then. */
+    if (!fd_d->cork_queued && !fd_d->cork_wait_out && !(fd_d->paused & (1 << TINYEV_RATE_WRITE))) {
+        if (tinyev_defer(cork_flush, fd_d)) {
+            cork_flush(fd_d);
+            return total;
+        }
+        fd_d->cork_queued = true;
+    }
+
+    return total;
+}
+
+void tinyev_set_data(void *evobj, void *data)
+{
+    if (evobj)
+        ((struct event_data *)evobj)->data = data;
+}
+
+int tinyev_set_rate(void *evobj, enum tinyev_rate_dir dir, const struct tinyev_rate *rate)
+{
+    struct event_data *fd_d = evobj;
+    struct rate_limit *l;
+
+    if (dir != TINYEV_RATE_READ && dir != TINYEV_RATE_WRITE) return TINYEV_ERR_ADD;
+
+    if (!fd_d) {
+        /* New buckets, nothing is held in them. */
+        l = &loop_rate[dir];
+        rate_round++;
+    } else {
+        if (!fd_d->limits) {
+            if (!rate) return TINYEV_ERR_OK;
+            fd_d->limits = calloc(RATE_DIRS, sizeof(struct rate_limit));
+            if (!fd_d->limits) return TINYEV_ERR_MEM;
+        }
+        l = &fd_d->limits[dir];
+    }
+
+    /* A paused fd is watched again by the timer if that lifted it. */
+    rate_users -= limit_set(l);
+    bucket_set(&l->bytes, rate ? rate->bytes_sec : 0, rate ? rate->burst_bytes : 0);
+    bucket_set(&l->ops, rate ? rate->ops_sec : 0, rate ? rate->burst_ops : 0);
+    rate_users += limit_set(l);
+
+    return TINYEV_ERR_OK;
+}
+
+void tinyev_rate_charge(void *evobj, enum tinyev_rate_dir dir, size_t bytes)
+{
+    if (!evobj || !rate_users || (dir != TINYEV_RATE_READ && dir != TINYEV_RATE_WRITE)) return;
+
+    rate_charge(evobj, dir, bytes, 0);
+}
+
+uint64_t tinyev_throttled_msec(void *evobj)
+{
+    struct event_data *fd_d = evobj;
+
+    if (!fd_d) return 0;
+
+    return fd_d->throttled_msec + (fd_d->paused ? loop_now - fd_d->paused_at : 0);
+}
+
+int tinyev_set_idle(void *evobj, int msec, event_cb cb)
+{
+    struct event_data *fd_d = evobj;
+
+    if (!fd_d) return TINYEV_ERR_ADD;
+
+    if (fd_d->idle_msec) {
+        idle_unlink(fd_d);
+        watched_idle--;
+        fd_d->idle_msec = 0;
+    }
+
+    if (msec <= 0) return TINYEV_ERR_OK;
+
+    /* Not the hot path, take a fresh time. */
+    loop_now = time_in_millisecs();
+    if (!watched_idle)
+        idle_tick = loop_now / IDLE_RES_MSEC - 1;
+
+    fd_d->idle_cb = cb;
+    fd_d->idle_msec = msec;
+    fd_d->last_active = loop_now;
+    idle_place(fd_d);
+    watched_idle++;
+
+    return TINYEV_ERR_OK;
+}
+
+void tinyev_touch(void *evobj)
+{
+    ((struct event_data *)evobj)->last_active = loop_now;
+}
+
+int tinyev_add_signal(int signo, event_cb cb, void *data)
+{
+    struct epoll_event ev;
+    sigset_t one;
+    int fd;
+
+    if (signo <= 0 || signo >= _NSIG || !cb) return TINYEV_ERR_ADD;
+
+    if (sig_fd == -1)
+        sigemptyset(&sig_mask);
+    sigaddset(&sig_mask, signo);
+
+    /* Blocked, so it's only delivered through the signalfd. */
+    sigemptyset(&one);
+    sigaddset(&one, signo);
+    if (pthread_sigmask(SIG_BLOCK, &one, NULL)) {
+        SLOG("Failed blocking signal %d", signo);
+        sigdelset(&sig_mask, signo);
+        return TINYEV_ERR_ADD;
+    }
+
+    fd = signalfd(sig_fd, &sig_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        SLOG("Failed signalfd");
+        sigdelset(&sig_mask, signo);
+        pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+        return TINYEV_ERR_ADD;
+    }
+
+    if (sig_fd == -1) {
+        sig_ev.cb = dispatch_signals;
+        sig_ev.internal = true;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &sig_ev;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            SLOG("epoll_ctl error add signalfd");
+            close(fd);
+            sigdelset(&sig_mask, signo);
+            pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+            return TINYEV_ERR_ADD;
+        }
+        sig_fd = fd;
+    }
+
+    sig_handlers[signo].cb = cb;
+    sig_handlers[signo].data = data;
+
+    return TINYEV_ERR_OK;
+}
+
+void tinyev_del_signal(int signo)
+{
+    sigset_t one;
+
+    if (signo <= 0 || signo >= _NSIG || !sig_handlers[signo].cb) return;
+
+    sig_handlers[signo].cb = NULL;
+    sigdelset(&sig_mask, signo);
+    signalfd(sig_fd, &sig_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    sigemptyset(&one);
+    sigaddset(&one, signo);
+    pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+}
+
+void tinyev_get_stats(struct tinyev_stats *st)
+{
+    *st = stats;
+}
+
+int tinyev_set_timestamping(void *evobj, int flags, tinyev_tx_ts_cb tx_cb)
+{
+    struct event_data *fd_d = evobj;
+    int val = 0;
+
+    if (!fd_d) return TINYEV_ERR_ADD;
+
+    if (flags & TINYEV_TS_RX)
+        val |= SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    /* Only the timestamp and the id come back, not the sent data. */
+    if (flags & TINYEV_TS_TX)
+        val |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+               SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    if (setsockopt(fd_d->fd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val)) < 0) {
+        SLOG("Failed setting SO_TIMESTAMPING, errno %d", errno);
+        return TINYEV_ERR_ADD;
+    }
+
+    fd_d->ts_flags = flags;
+    fd_d->tx_ts_cb = tx_cb;
+    fd_d->rx_ts.tv_sec = fd_d->rx_ts.tv_nsec = 0;
+
+    return TINYEV_ERR_OK;
+}
+
+bool tinyev_rx_timestamp(void *evobj, struct timespec *ts)
+{
+    struct event_data *fd_d = evobj;
+
+    if (!fd_d || !fd_d->rx_ts.tv_sec) return false;
+
+    *ts = fd_d->rx_ts;
+
+    return true;
+}
+
+ssize_t tinyev_recv_ts(int fd, void *buf, size_t len, struct timespec *ts)
+{
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    struct msghdr msg = {0};
+    struct cmsghdr *cm;
+    ssize_t bytes;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ts->tv_sec = ts->tv_nsec = 0;
+    bytes = recvmsg(fd, &msg, 0);
+    if (bytes <= 0) return bytes;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+            *ts = ((struct scm_timestamping *)CMSG_DATA(cm))->ts[0];
+    }
+
+    return bytes;
+}
+
+void tinyev_get_rx_delay(struct tinyev_hist *h)
+{
+    *h = rx_delay;
+}
+
+void tinyev_reset_rx_delay()
+{
+    tinyev_hist_reset(&rx_delay);
+}
+
+void tinyev_set_lateness_hist(struct tinyev_hist *h)
+{
+    late_hist = h;
+}
+
+uint64_t tinyev_now()
+{
+    return time_in_millisecs();
+}
+
+void tinyev_set_clock(tinyev_clock_fn fn, void *data)
+{
+    clock_fn = fn;
+    clock_data = data;
+
+    loop_now = time_in_millisecs();
+    idle_tick = loop_now / IDLE_RES_MSEC - 1;
+}
+
+void tinyev_sim_start(uint64_t start_msec)
+{
+    sim_now = start_msec;
+    tinyev_set_clock(sim_clock, NULL);
+}
+
+int tinyev_sim_inject(void *evobj, uint64_t at_msec)
+{
+    struct sim_event *se, *tmp_s = sim_events_tail;
+
+    if (clock_fn != sim_clock || !evobj) return TINYEV_ERR_ADD;
+
+    se = calloc(1, sizeof(struct sim_event));
+    if (!se) {
+        SLOG("Failed allocating sim event");
+        return TINYEV_ERR_MEM;
+    }
+    se->fd_d = evobj;
+    se->at_msec = at_msec;
+
+    /* Traces come in time order, start from the tail. */
+    while (tmp_s && tmp_s->at_msec > at_msec)
+        tmp_s = tmp_s->prev;
+
+    se->prev = tmp_s;
+    se->next = tmp_s ? tmp_s->next : sim_events;
+    if (se->next)
+        se->next->prev = se;
+    else
+        sim_events_tail = se;
+    if (tmp_s)
+        tmp_s->next = se;
+    else
+        sim_events = se;
+
+    se->fd_next = se->fd_d->sim_list;
+    if (se->fd_next)
+        se->fd_next->fd_prev = se;
+    se->fd_d->sim_list = se;
+
+    return TINYEV_ERR_OK;
 }
 
 int tinyev_init()
@@ -306,6 +1812,10 @@ int tinyev_init()
         return TINYEV_ERR_INIT;
     }
 
+    loop_now = time_in_millisecs();
+    idle_tick = loop_now / IDLE_RES_MSEC - 1;
+    tinyev_hist_reset(&rx_delay);
+
     SLOG("Tinyev is ready");
 
     return TINYEV_ERR_OK;
@@ -313,7 +1823,40 @@ int tinyev_init()
 
 void tinyev_cleanup()
 {
+    struct timer_obj *td;
+    struct sim_event *se;
+
     SLOG("Cleaning all, timers %d\n", watched_timers);
+    while ((se = sim_events)) {
+        sim_unlink(se);
+        free(se);
+    }
+    clock_fn = NULL;
+    clock_data = NULL;
+    if (rate_timer)
+        do_del_timer(rate_timer);
+    rate_timer = NULL;
+    while ((td = free_timers)) {
+        free_timers = td->next;
+        free(td);
+    }
+    memset(loop_rate, 0, sizeof(loop_rate));
+    rate_users = 0;
+    paused_fds = paused_tail = NULL;
+    rate_round++;
+    rate_holding = false;
+    free(defer_q);
+    free(defer_run);
+    defer_q = defer_run = NULL;
+    defer_len = defer_cap = run_len = run_cap = 0;
+
+    if (sig_fd != -1) {
+        pthread_sigmask(SIG_UNBLOCK, &sig_mask, NULL);
+        memset(sig_handlers, 0, sizeof(sig_handlers));
+        close(sig_fd);
+        sig_fd = -1;
+    }
+
     if (epoll_fd == -1) {
         SLOG("Already finalized epoll, or never initialized");
         return;
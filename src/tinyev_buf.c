@@ -0,0 +1,182 @@
+/**
+ * @file tinyev_buf.c
+ * @brief read buffer pool. Buffers are carved out of 2MB slabs in a few
+ * size classes and kept on free lists once returned, so a connection only
+ * holds memory while it has unconsumed data.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include "log.h"
+#include "error.h"
+#include "tinyev_buf.h"
+
+/* Defines. */
+#define SLAB_SIZE (2 * 1024 * 1024)     // Huge page size on x86_64 and arm64
+#define BUF_CLASSES 5                   // Number of size classes
+#define BUF_MALLOC BUF_CLASSES          // Class of buffers too big for the pool
+
+/* Structures. */
+/* Sits right before the buffer. */
+struct buf_hdr {
+    struct buf_hdr *next;               // Free list link
+    uint32_t cls;
+    uint32_t size;
+};
+
+/* Start of every slab. */
+struct slab {
+    struct slab *next;
+    size_t size;
+};
+
+struct buf_class {
+    struct buf_hdr *free;
+    char *bump;                         // Never used part of the last slab
+    char *end;
+};
+
+/* ==*== GLOBAL VARIABLES ==*== */
+
+static const uint32_t class_size[BUF_CLASSES] = {256, 1024, 4096, 16384, 65536};
+static struct buf_class classes[BUF_CLASSES];
+static struct slab *slabs = NULL;
+static int pool_flags = 0;
+static size_t mapped_bytes = 0;
+static size_t used_bytes = 0;
+
+void tinyev_buf_pool_config(int flags)
+{
+    pool_flags = flags;
+}
+
+static void *slab_map()
+{
+    struct slab *sl = MAP_FAILED;
+
+    if (pool_flags & TINYEV_BUF_HUGE) {
+        sl = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (sl == MAP_FAILED)
+            SLOG("No reserved huge pages, using THP");
+    }
+
+    if (sl == MAP_FAILED) {
+        sl = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (sl == MAP_FAILED) {
+            SLOG("Failed mapping buffer slab");
+            return NULL;
+        }
+        if (pool_flags & TINYEV_BUF_HUGE)
+            madvise(sl, SLAB_SIZE, MADV_HUGEPAGE);
+    }
+
+    sl->size = SLAB_SIZE;
+    sl->next = slabs;
+    slabs = sl;
+    mapped_bytes += SLAB_SIZE;
+
+    return sl;
+}
+
+/* Hand out from the untouched part of the slab, so pages are only faulted
+    in once a buffer is really needed. */
+static struct buf_hdr *class_grow(uint32_t cls)
+{
+    struct buf_class *bc = &classes[cls];
+    size_t need = sizeof(struct buf_hdr) + class_size[cls];
+    struct buf_hdr *hdr;
+    char *sl;
+
+    if (bc->end - bc->bump < (ptrdiff_t)need) {
+        sl = slab_map();
+        if (!sl) return NULL;
+        bc->bump = sl + sizeof(struct slab);
+        bc->end = sl + SLAB_SIZE;
+    }
+
+    hdr = (struct buf_hdr *)bc->bump;
+    bc->bump += need;
+
+    return hdr;
+}
+
+int tinyev_buf_alloc(size_t size, struct tinyev_buf *buf)
+{
+    struct buf_hdr *hdr;
+    uint32_t cls = 0;
+
+    while (cls < BUF_CLASSES && class_size[cls] < size)
+        cls++;
+
+    if (cls == BUF_MALLOC) {
+        hdr = malloc(sizeof(struct buf_hdr) + size);
+        if (hdr) hdr->size = size;
+    } else if (classes[cls].free) {
+        hdr = classes[cls].free;
+        classes[cls].free = hdr->next;
+    } else {
+        hdr = class_grow(cls);
+        if (hdr) hdr->size = class_size[cls];
+    }
+
+    if (!hdr) {
+        buf->base = NULL;
+        buf->len = 0;
+        return TINYEV_ERR_MEM;
+    }
+
+    hdr->cls = cls;
+    used_bytes += hdr->size;
+    buf->base = (char *)(hdr + 1);
+    buf->len = hdr->size;
+
+    return TINYEV_ERR_OK;
+}
+
+void tinyev_buf_free(struct tinyev_buf *buf)
+{
+    struct buf_hdr *hdr;
+
+    if (!buf->base) return;
+
+    hdr = (struct buf_hdr *)buf->base - 1;
+    used_bytes -= hdr->size;
+    if (hdr->cls == BUF_MALLOC) {
+        free(hdr);
+    } else {
+        hdr->next = classes[hdr->cls].free;
+        classes[hdr->cls].free = hdr;
+    }
+
+    buf->base = NULL;
+    buf->len = 0;
+}
+
+void tinyev_buf_pool_usage(size_t *mapped, size_t *in_use)
+{
+    *mapped = mapped_bytes;
+    *in_use = used_bytes;
+}
+
+void tinyev_buf_pool_cleanup()
+{
+    struct slab *sl;
+    int i;
+
+    while (slabs) {
+        sl = slabs;
+        slabs = sl->next;
+        munmap(sl, sl->size);
+    }
+
+    for (i = 0; i < BUF_CLASSES; i++)
+        classes[i] = (struct buf_class){0};
+    mapped_bytes = 0;
+}
@@ -0,0 +1,411 @@
+/**
+ * @file tinyev_co.c
+ * @brief stackful coroutines on top of the tinyev loop. Every coroutine
+ * runs on its own pooled stack, and a wait on an fd or a timer is just a
+ * switch back to whoever resumed it (usually tinyev_poll()). The fds are
+ * watched edge triggered, so each one is added to epoll only once.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+
+#include "log.h"
+#include "tinyev_co.h"
+
+/* Defines. */
+#ifndef TINYEV_CO_STACK_SIZE
+#   define TINYEV_CO_STACK_SIZE (64 * 1024)     // Usable stack, guard excluded
+#endif
+#define CO_GUARD_SIZE 4096                      // One PROT_NONE page under the stack
+#define CO_FDS_MIN 64                           // First size of the fd table
+
+#if !defined(__x86_64__)
+#   include <ucontext.h>
+#endif
+
+/* Structures. */
+/* Lives at the top of its own stack mapping. */
+struct tinyev_co {
+    struct tinyev_co *next;             // Pool link
+    tinyev_co_fn fn;
+    void *arg;
+    bool done;
+    bool closed;                        // Its fd was closed while it waited
+#if defined(__x86_64__)
+    void *sp;                           // Saved stack pointer of the coroutine
+    void *caller_sp;                    // Saved stack pointer of the resumer
+#else
+    ucontext_t ctx;
+    ucontext_t caller_ctx;
+#endif
+};
+
+/* Waiters of a single fd. */
+struct co_fd {
+    void *tev;
+    struct tinyev_co *reader;
+    struct tinyev_co *writer;
+};
+
+/* ==*== GLOBAL VARIABLES ==*== */
+
+static struct tinyev_co *current = NULL;
+static struct tinyev_co *pool = NULL;
+/* Indexed by fd. */
+static struct co_fd *co_fds = NULL;
+static int co_fds_len = 0;
+
+#if defined(__x86_64__)
+/* Save the callee saved registers and the SSE and x87 control words on the
+    current stack, store the stack pointer in *from and continue from the
+    stack pointer 'to'. */
+void co_switch(void **from, void *to);
+__asm__(
+    ".text\n"
+    ".hidden co_switch\n"
+    ".globl co_switch\n"
+    ".type co_switch,@function\n"
+    "co_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size co_switch,.-co_switch\n"
+);
+#endif
+
+static void co_entry()
+{
+    struct tinyev_co *co = current;
+
+    co->fn(co->arg);
+    co->done = true;
+
+    /* Never comes back here, the resumer puts the stack back to the pool. */
+#if defined(__x86_64__)
+    co_switch(&co->sp, co->caller_sp);
+#else
+    swapcontext(&co->ctx, &co->caller_ctx);
+#endif
+}
+
+static struct tinyev_co *co_alloc()
+{
+    struct tinyev_co *co;
+    char *base;
+
+    if (pool) {
+        co = pool;
+        pool = co->next;
+        return co;
+    }
+
+    base = mmap(NULL, CO_GUARD_SIZE + TINYEV_CO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED) {
+        SLOG("Failed mapping coroutine stack");
+        return NULL;
+    }
+
+    if (mprotect(base, CO_GUARD_SIZE, PROT_NONE) < 0) {
+        SLOG("Failed protecting guard page");
+        munmap(base, CO_GUARD_SIZE + TINYEV_CO_STACK_SIZE);
+        return NULL;
+    }
+
+    /* Coroutine object on top, the stack grows down from right below it. */
+    co = (struct tinyev_co *)(base + CO_GUARD_SIZE + TINYEV_CO_STACK_SIZE) - 1;
+
+    return co;
+}
+
+static void co_prepare(struct tinyev_co *co)
+{
+#if defined(__x86_64__)
+    uintptr_t top = ((uintptr_t)co) & ~(uintptr_t)15;
+    void **sp = (void **)top;
+
+    /* Fake frame popped by co_switch: the control words, six registers and
+        a return address into co_entry, plus a dummy return address for
+        co_entry itself so it sees a call-aligned stack. The control words
+        start as the creator's. */
+    *--sp = NULL;
+    *--sp = (void *)co_entry;
+    sp -= 6;
+    memset(sp, 0, 6 * sizeof(void *));
+    sp--;
+    __asm__ volatile("stmxcsr (%0)\n\tfnstcw 4(%0)" : : "r"(sp) : "memory");
+    co->sp = sp;
+#else
+    /* From right above the guard page up to the coroutine object. */
+    char *bottom = (char *)(co + 1) - TINYEV_CO_STACK_SIZE;
+
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = bottom;
+    co->ctx.uc_stack.ss_size = (char *)co - bottom;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, co_entry, 0);
+#endif
+}
+
+void tinyev_co_resume(void *cobj)
+{
+    struct tinyev_co *co = cobj;
+    struct tinyev_co *prev = current;
+
+    current = co;
+#if defined(__x86_64__)
+    co_switch(&co->caller_sp, co->sp);
+#else
+    swapcontext(&co->caller_ctx, &co->ctx);
+#endif
+    current = prev;
+
+    if (co->done) {
+        SLOG("Coroutine %p finished", co);
+        co->next = pool;
+        pool = co;
+    }
+}
+
+void tinyev_co_suspend()
+{
+    struct tinyev_co *co = current;
+
+#if defined(__x86_64__)
+    co_switch(&co->sp, co->caller_sp);
+#else
+    swapcontext(&co->ctx, &co->caller_ctx);
+#endif
+}
+
+void *tinyev_co_self()
+{
+    return current;
+}
+
+int tinyev_co_spawn(tinyev_co_fn fn, void *arg)
+{
+    struct tinyev_co *co = co_alloc();
+
+    if (!co) {
+        return TINYEV_ERR_MEM;
+    }
+
+    co->fn = fn;
+    co->arg = arg;
+    co->done = false;
+    co_prepare(co);
+
+    tinyev_co_resume(co);
+
+    return TINYEV_ERR_OK;
+}
+
+/* Both waiters retry their call, a spurious wake up just costs EAGAIN. */
+static void co_fd_cb(void *data)
+{
+    int fd = (int)(intptr_t)data;
+    struct tinyev_co *co;
+
+    co = co_fds[fd].reader;
+    if (co) {
+        co_fds[fd].reader = NULL;
+        tinyev_co_resume(co);
+    }
+
+    /* The reader may have closed the fd. */
+    co = co_fds[fd].writer;
+    if (co) {
+        co_fds[fd].writer = NULL;
+        tinyev_co_resume(co);
+    }
+}
+
+static struct co_fd *co_fd_get(int fd)
+{
+    struct co_fd *tmp;
+    int len, err;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    if (fd >= co_fds_len) {
+        len = co_fds_len ? co_fds_len : CO_FDS_MIN;
+        while (len <= fd) len *= 2;
+
+        tmp = realloc(co_fds, len * sizeof(struct co_fd));
+        if (!tmp) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        memset(tmp + co_fds_len, 0, (len - co_fds_len) * sizeof(struct co_fd));
+        co_fds = tmp;
+        co_fds_len = len;
+    }
+
+    if (!co_fds[fd].tev) {
+        co_fds[fd].tev = tinyev_add_fd(fd, (void *)(intptr_t)fd, co_fd_cb,
+                                       TEV_RECV | TEV_SEND | TEV_ERROR | TEV_EDGE, &err);
+        if (!co_fds[fd].tev) {
+            SLOG("Failed adding fd %d, err %d", fd, err);
+            return NULL;
+        }
+    }
+
+    return &co_fds[fd];
+}
+
+/* False when tinyev_co_close() closed the fd meanwhile, errno is EBADF. */
+static bool co_wait(int fd, bool write)
+{
+    struct tinyev_co *co = current;
+
+    co->closed = false;
+    if (write)
+        co_fds[fd].writer = co;
+    else
+        co_fds[fd].reader = co;
+
+    tinyev_co_suspend();
+
+    if (co->closed) {
+        errno = EBADF;
+        return false;
+    }
+
+    return true;
+}
+
+ssize_t tinyev_co_read(int fd, void *buf, size_t len)
+{
+    ssize_t bytes;
+
+    if (!co_fd_get(fd)) return -1;
+
+    while ((bytes = read(fd, buf, len)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            break;
+        if (errno != EINTR && !co_wait(fd, false))
+            break;
+    }
+
+    return bytes;
+}
+
+ssize_t tinyev_co_write(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    size_t left = len;
+    ssize_t bytes;
+
+    if (!co_fd_get(fd)) return -1;
+
+    while (left) {
+        bytes = write(fd, p, left);
+        if (bytes < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return -1;
+            if (errno != EINTR && !co_wait(fd, true))
+                return -1;
+            continue;
+        }
+        p += bytes;
+        left -= bytes;
+    }
+
+    return len;
+}
+
+int tinyev_co_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    int sock;
+
+    if (!co_fd_get(fd)) return -1;
+
+    while ((sock = accept(fd, addr, addrlen)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            break;
+        if (errno != EINTR && !co_wait(fd, false))
+            break;
+    }
+
+    return sock;
+}
+
+void tinyev_co_sleep(int sec, int msec)
+{
+    if (!tinyev_add_timer(sec, msec, current, tinyev_co_resume)) {
+        SLOG("Failed adding sleep timer");
+        return;
+    }
+
+    tinyev_co_suspend();
+}
+
+void tinyev_co_close(int fd)
+{
+    struct tinyev_co *reader, *writer;
+
+    if (fd < 0 || fd >= co_fds_len || !co_fds[fd].tev) {
+        close(fd);
+        return;
+    }
+
+    reader = co_fds[fd].reader;
+    writer = co_fds[fd].writer;
+    tinyev_remove_fd(fd, co_fds[fd].tev);
+    memset(&co_fds[fd], 0, sizeof(struct co_fd));
+
+    /* Their calls fail, instead of waiting for good. */
+    if (reader) {
+        reader->closed = true;
+        tinyev_co_resume(reader);
+    }
+    if (writer) {
+        writer->closed = true;
+        tinyev_co_resume(writer);
+    }
+}
+
+void tinyev_co_cleanup()
+{
+    struct tinyev_co *co;
+
+    while (pool) {
+        co = pool;
+        pool = co->next;
+        munmap((char *)(co + 1) - TINYEV_CO_STACK_SIZE - CO_GUARD_SIZE,
+               CO_GUARD_SIZE + TINYEV_CO_STACK_SIZE);
+    }
+
+    free(co_fds);
+    co_fds = NULL;
+    co_fds_len = 0;
+}
@@ -0,0 +1,485 @@
+/**
+ * @file tinyev_connect.c
+ * @brief outbound connections without blocking the loop: non-blocking
+ * connect() raced over the addresses of a host, Happy Eyeballs style, with
+ * the name resolution done on a few resolver threads that wake the loop
+ * through an eventfd.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <signal.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "tinyev_connect.h"
+
+/* Defines. */
+#define RESOLVER_THREADS 4
+
+/* Structures. */
+struct connect_req;
+
+/* One connect() in the race. */
+struct attempt {
+    struct connect_req *req;
+    int fd;
+    void *tev;
+};
+
+struct connect_req {
+    tinyev_connect_cb cb;
+    void *data;
+    struct sockaddr_storage addrs[TINYEV_CONNECT_MAX_ADDRS];
+    socklen_t lens[TINYEV_CONNECT_MAX_ADDRS];
+    struct attempt att[TINYEV_CONNECT_MAX_ADDRS];
+    int naddrs;
+    int next;                           // Next address to try
+    int in_flight;
+    int last_err;
+    int stagger;
+    void *stagger_timer;
+    void *timeout_timer;
+    /* Name resolution, see tinyev_connect_host(). */
+    struct connect_req *rnext;          // Resolver queues
+    char *host;
+    char *port;
+    struct addrinfo *res;
+    int res_err;
+    bool resolving;                     // Owned by the resolver meanwhile
+    bool canceled;                      // Release once resolved
+};
+
+/* ==*== GLOBAL VARIABLES ==*== */
+
+/* Resolver threads, lookups to do and lookups done, under res_lock. */
+static pthread_mutex_t res_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t res_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t res_threads[RESOLVER_THREADS];
+static int res_nthreads = 0;
+static bool res_stop = false;
+static struct connect_req *res_todo = NULL;
+static struct connect_req *res_todo_tail = NULL;
+static struct connect_req *res_done = NULL;
+/* Wakes the loop when lookups are done. */
+static int res_efd = -1;
+static void *res_tev = NULL;
+
+static void req_free(struct connect_req *req)
+{
+    if (req->res)
+        freeaddrinfo(req->res);
+    free(req->host);
+    free(req->port);
+    free(req);
+}
+
+/* Close every attempt and stop the timers. */
+static void req_abort(struct connect_req *req)
+{
+    int i;
+
+    for (i = 0; i < req->next; i++) {
+        if (req->att[i].tev) {
+            tinyev_remove_fd(req->att[i].fd, req->att[i].tev);
+            req->att[i].tev = NULL;
+        }
+    }
+    req->in_flight = 0;
+
+    if (req->stagger_timer) {
+        tinyev_del_timer(req->stagger_timer);
+        req->stagger_timer = NULL;
+    }
+    if (req->timeout_timer) {
+        tinyev_del_timer(req->timeout_timer);
+        req->timeout_timer = NULL;
+    }
+}
+
+/* Release the request, then tell the user. */
+static void req_finish(struct connect_req *req, int fd, int err)
+{
+    tinyev_connect_cb cb = req->cb;
+    void *data = req->data;
+
+    req_abort(req);
+    if (req->resolving)
+        req->canceled = true;
+    else
+        req_free(req);
+
+    cb(data, fd, err);
+}
+
+/* Families alternate, starting with the family of the first address. */
+static void req_set_addrs(struct connect_req *req, const struct addrinfo *addrs)
+{
+    const struct addrinfo *first[TINYEV_CONNECT_MAX_ADDRS], *other[TINYEV_CONNECT_MAX_ADDRS];
+    const struct addrinfo *ai;
+    int nfirst = 0, nother = 0, i = 0, j = 0;
+
+    for (ai = addrs; ai; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+        if (ai->ai_family == addrs->ai_family) {
+            if (nfirst < TINYEV_CONNECT_MAX_ADDRS) first[nfirst++] = ai;
+        } else if (nother < TINYEV_CONNECT_MAX_ADDRS) {
+            other[nother++] = ai;
+        }
+    }
+
+    req->naddrs = 0;
+    while (req->naddrs < TINYEV_CONNECT_MAX_ADDRS && (i < nfirst || j < nother)) {
+        ai = (i < nfirst && (i <= j || j == nother)) ? first[i++] : other[j++];
+        memcpy(&req->addrs[req->naddrs], ai->ai_addr, ai->ai_addrlen);
+        req->lens[req->naddrs] = ai->ai_addrlen;
+        req->naddrs++;
+    }
+}
+
+static void attempt_cb(void *udata);
+static void stagger_cb(void *udata);
+
+/* Start the next address, skipping the ones that fail right away. */
+static bool req_start_next(struct connect_req *req)
+{
+    struct attempt *a;
+    int fd, err;
+
+    while (req->next < req->naddrs) {
+        a = &req->att[req->next];
+        fd = socket(req->addrs[req->next].ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            req->last_err = -errno;
+            req->next++;
+            continue;
+        }
+
+        if (connect(fd, (struct sockaddr *)&req->addrs[req->next], req->lens[req->next]) < 0 &&
+            errno != EINPROGRESS) {
+            req->last_err = -errno;
+            close(fd);
+            req->next++;
+            continue;
+        }
+        req->next++;
+
+        /* Writable once connected or failed, even when it's done already. */
+        a->req = req;
+        a->fd = fd;
+        a->tev = tinyev_add_fd(fd, a, attempt_cb, TEV_SEND | TEV_ERROR, &err);
+        if (!a->tev) {
+            req->last_err = -ENOMEM;
+            close(fd);
+            continue;
+        }
+        req->in_flight++;
+
+        if (req->next < req->naddrs)
+            req->stagger_timer = tinyev_add_timer(0, req->stagger, req, stagger_cb);
+
+        return true;
+    }
+
+    return false;
+}
+
+static void stagger_cb(void *udata)
+{
+    struct connect_req *req = udata;
+
+    req->stagger_timer = NULL;
+    if (!req_start_next(req) && !req->in_flight)
+        req_finish(req, -1, req->last_err);
+}
+
+static void attempt_cb(void *udata)
+{
+    struct attempt *a = udata;
+    struct connect_req *req = a->req;
+    socklen_t len = sizeof(int);
+    int so_err = 0, fd = a->fd;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_err, &len) < 0)
+        so_err = errno;
+
+    req->in_flight--;
+    if (!so_err) {
+        /* Won the race, the fd is the user's now. */
+        tinyev_detach_fd(fd, a->tev);
+        a->tev = NULL;
+        req_finish(req, fd, 0);
+        return;
+    }
+
+    SLOG("Connect attempt failed, errno %d", so_err);
+    req->last_err = -so_err;
+    tinyev_remove_fd(fd, a->tev);
+    a->tev = NULL;
+
+    /* The next address doesn't wait for its turn. */
+    if (req->stagger_timer) {
+        tinyev_del_timer(req->stagger_timer);
+        req->stagger_timer = NULL;
+    }
+    if (!req_start_next(req) && !req->in_flight)
+        req_finish(req, -1, req->last_err);
+}
+
+static void timeout_cb(void *udata)
+{
+    struct connect_req *req = udata;
+
+    req->timeout_timer = NULL;
+    req_finish(req, -1, -ETIMEDOUT);
+}
+
+static struct connect_req *req_new(int stagger_msec, tinyev_connect_cb cb, void *data)
+{
+    struct connect_req *req = calloc(1, sizeof(struct connect_req));
+
+    if (!req) {
+        SLOG("Failed allocating connect request");
+        return NULL;
+    }
+
+    req->cb = cb;
+    req->data = data;
+    req->stagger = stagger_msec > 0 ? stagger_msec : TINYEV_CONNECT_STAGGER;
+    req->last_err = -EHOSTUNREACH;
+
+    return req;
+}
+
+static void *resolver_main(void *unused)
+{
+    struct addrinfo hints = {0};
+    struct connect_req *req;
+    uint64_t one = 1;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    pthread_mutex_lock(&res_lock);
+    while (1) {
+        while (!res_todo && !res_stop)
+            pthread_cond_wait(&res_cond, &res_lock);
+        if (res_stop) break;
+
+        req = res_todo;
+        res_todo = req->rnext;
+        if (!res_todo)
+            res_todo_tail = NULL;
+        pthread_mutex_unlock(&res_lock);
+
+        req->res_err = getaddrinfo(req->host, req->port, &hints, &req->res);
+
+        pthread_mutex_lock(&res_lock);
+        req->rnext = res_done;
+        res_done = req;
+        if (write(res_efd, &one, sizeof(one)) != sizeof(one))
+            SLOG("Failed waking the loop, errno %d", errno);
+    }
+    pthread_mutex_unlock(&res_lock);
+
+    return NULL;
+}
+
+/* Loop side of the resolver, carry on with the lookups that are done. */
+static void resolved_cb(void *unused)
+{
+    struct connect_req *list, *req;
+    uint64_t count;
+
+    if (read(res_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        SLOG("Failed reading the resolver eventfd, errno %d", errno);
+
+    pthread_mutex_lock(&res_lock);
+    list = res_done;
+    res_done = NULL;
+    pthread_mutex_unlock(&res_lock);
+
+    while ((req = list)) {
+        list = req->rnext;
+        req->resolving = false;
+
+        if (req->canceled) {
+            req_free(req);
+            continue;
+        }
+
+        if (req->res_err) {
+            SLOG("Failed resolving %s: %s", req->host, gai_strerror(req->res_err));
+            req_finish(req, -1, -EHOSTUNREACH);
+            continue;
+        }
+
+        req_set_addrs(req, req->res);
+        freeaddrinfo(req->res);
+        req->res = NULL;
+        if (!req_start_next(req))
+            req_finish(req, -1, req->last_err);
+    }
+}
+
+static int resolver_start()
+{
+    sigset_t all, old;
+    int err;
+
+    if (res_nthreads) return TINYEV_ERR_OK;
+
+    res_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (res_efd < 0) {
+        SLOG("Failed creating the resolver eventfd");
+        return TINYEV_ERR_INIT;
+    }
+
+    res_tev = tinyev_add_fd(res_efd, NULL, resolved_cb, TEV_RECV | TEV_INTERNAL, &err);
+    if (!res_tev) {
+        close(res_efd);
+        res_efd = -1;
+        return err;
+    }
+
+    /* Signals are for the loop's signalfd, the threads inherit the mask. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    res_stop = false;
+    while (res_nthreads < RESOLVER_THREADS &&
+           !pthread_create(&res_threads[res_nthreads], NULL, resolver_main, NULL))
+        res_nthreads++;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!res_nthreads) {
+        SLOG("Failed starting resolver threads");
+        tinyev_remove_fd(res_efd, res_tev);
+        res_efd = -1;
+        res_tev = NULL;
+        return TINYEV_ERR_INIT;
+    }
+
+    return TINYEV_ERR_OK;
+}
+
+void *tinyev_connect(const struct addrinfo *addrs, int timeout_msec, int stagger_msec,
+                     tinyev_connect_cb cb, void *data, int *err)
+{
+    struct connect_req *req = req_new(stagger_msec, cb, data);
+
+    if (!req) {
+        *err = TINYEV_ERR_MEM;
+        return NULL;
+    }
+
+    req_set_addrs(req, addrs);
+    if (!req_start_next(req)) {
+        SLOG("No address could be tried, last errno %d", -req->last_err);
+        req_free(req);
+        *err = TINYEV_ERR_ADD;
+        return NULL;
+    }
+
+    if (timeout_msec > 0)
+        req->timeout_timer = tinyev_add_timer(0, timeout_msec, req, timeout_cb);
+
+    *err = TINYEV_ERR_OK;
+
+    return req;
+}
+
+void *tinyev_connect_host(const char *host, const char *port, int timeout_msec,
+                          tinyev_connect_cb cb, void *data, int *err)
+{
+    struct connect_req *req;
+
+    *err = resolver_start();
+    if (*err) return NULL;
+
+    req = req_new(0, cb, data);
+    if (!req) {
+        *err = TINYEV_ERR_MEM;
+        return NULL;
+    }
+
+    req->host = strdup(host);
+    req->port = strdup(port);
+    if (!req->host || !req->port) {
+        req_free(req);
+        *err = TINYEV_ERR_MEM;
+        return NULL;
+    }
+
+    if (timeout_msec > 0)
+        req->timeout_timer = tinyev_add_timer(0, timeout_msec, req, timeout_cb);
+
+    req->resolving = true;
+    pthread_mutex_lock(&res_lock);
+    if (res_todo_tail)
+        res_todo_tail->rnext = req;
+    else
+        res_todo = req;
+    res_todo_tail = req;
+    pthread_cond_signal(&res_cond);
+    pthread_mutex_unlock(&res_lock);
+
+    *err = TINYEV_ERR_OK;
+
+    return req;
+}
+
+void tinyev_connect_cancel(void *r)
+{
+    struct connect_req *req = r;
+
+    if (!req) return;
+
+    req_abort(req);
+    if (req->resolving)
+        req->canceled = true;
+    else
+        req_free(req);
+}
+
+void tinyev_connect_cleanup()
+{
+    struct connect_req *req;
+    int i;
+
+    if (!res_nthreads) return;
+
+    pthread_mutex_lock(&res_lock);
+    res_stop = true;
+    pthread_cond_broadcast(&res_cond);
+    pthread_mutex_unlock(&res_lock);
+
+    for (i = 0; i < res_nthreads; i++)
+        pthread_join(res_threads[i], NULL);
+    res_nthreads = 0;
+
+    /* Lookups that never finished or were never picked up. */
+    while ((req = res_todo)) {
+        res_todo = req->rnext;
+        req_abort(req);
+        req_free(req);
+    }
+    res_todo_tail = NULL;
+    while ((req = res_done)) {
+        res_done = req->rnext;
+        req_abort(req);
+        req_free(req);
+    }
+
+    tinyev_remove_fd(res_efd, res_tev);
+    res_efd = -1;
+    res_tev = NULL;
+}
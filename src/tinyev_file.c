@@ -0,0 +1,643 @@
+/**
+ * @file tinyev_file.c
+ * @brief file reads, writes and fsyncs that complete through loop
+ * callbacks, since epoll reports regular files as always ready. Runs on
+ * io_uring through the raw syscalls, or on a small thread pool when the
+ * kernel doesn't allow it. Either way completions wake the loop through an
+ * eventfd.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "log.h"
+#include "tinyev_file.h"
+
+/* Defines. */
+#define URING_ENTRIES 256           // Submission queue size
+#define FILE_THREADS 4
+#define OPS_CHUNK 64                // Operations allocated at once
+#define ABUF_CLASSES 9              // Aligned buffers of 4KB to 1MB
+#define URING_MAX_LEN 0x7ffff000    // Most the kernel moves in one read or write
+
+/* Structures. */
+enum file_op_type {
+    FILE_OP_READ = 0,
+    FILE_OP_WRITE,
+    FILE_OP_FSYNC
+};
+
+struct file_op {
+    struct file_op *next;           // Free list, queues
+    enum file_op_type type;
+    int fd;
+    void *buf;
+    size_t len;
+    off_t off;
+    bool datasync;
+    ssize_t res;
+    tinyev_file_cb cb;
+    void *data;
+};
+
+/* Rings shared with the kernel. */
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_entries;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned sq_tail_local;         // Filled, not given to the kernel yet
+    unsigned to_submit;
+};
+
+/* ==*== GLOBAL VARIABLES ==*== */
+
+static enum tinyev_file_backend backend = TINYEV_FILE_AUTO;
+static struct uring ring = {.fd = -1};
+/* Completions wake the loop. */
+static int done_efd = -1;
+static void *done_tev = NULL;
+/* Unused operations, loop thread only. */
+static struct file_op *free_ops = NULL;
+/* Issued in this iteration, not submitted yet. */
+static struct file_op *batch = NULL;
+static struct file_op *batch_tail = NULL;
+static bool flush_queued = false;
+/* Thread pool queues, under pool_lock. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_threads[FILE_THREADS];
+static int pool_nthreads = 0;
+static bool pool_stop = false;
+static struct file_op *pool_todo = NULL;
+static struct file_op *pool_todo_tail = NULL;
+static struct file_op *pool_done = NULL;
+/* Free aligned buffers by size class. */
+static void *abuf_free[ABUF_CLASSES];
+
+static struct file_op *op_get()
+{
+    struct file_op *ops;
+    int i;
+
+    if (!free_ops) {
+        ops = calloc(OPS_CHUNK, sizeof(struct file_op));
+        if (!ops) return NULL;
+        for (i = 0; i < OPS_CHUNK; i++) {
+            ops[i].next = free_ops;
+            free_ops = &ops[i];
+        }
+    }
+
+    ops = free_ops;
+    free_ops = ops->next;
+    ops->next = NULL;
+
+    return ops;
+}
+
+static void op_put(struct file_op *op)
+{
+    op->next = free_ops;
+    free_ops = op;
+}
+
+/* The user may issue more from the callback, op is free by then. */
+static void op_complete(struct file_op *op, ssize_t res)
+{
+    tinyev_file_cb cb = op->cb;
+    void *data = op->data;
+
+    op_put(op);
+    cb(data, res);
+}
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_unmap()
+{
+    if (ring.sqes)
+        munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ptr && ring.cq_ptr != ring.sq_ptr)
+        munmap(ring.cq_ptr, ring.cq_size);
+    if (ring.sq_ptr)
+        munmap(ring.sq_ptr, ring.sq_size);
+    if (ring.fd != -1)
+        close(ring.fd);
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+static int uring_setup()
+{
+    struct io_uring_params p = {0};
+
+    ring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring.fd < 0) {
+        SLOG("io_uring not available, errno %d", errno);
+        ring.fd = -1;
+        return TINYEV_ERR_INIT;
+    }
+    /* IORING_OP_READ and WRITE came along with it in 5.6. */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        SLOG("io_uring too old for plain reads and writes");
+        goto fail;
+    }
+
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    /* Both rings in one mapping since 5.4. */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_size > ring.sq_size) ring.sq_size = ring.cq_size;
+        ring.cq_size = ring.sq_size;
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED) {
+        ring.sq_ptr = NULL;
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED) {
+            ring.cq_ptr = NULL;
+            goto fail;
+        }
+    }
+
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        goto fail;
+    }
+
+    ring.sq_head = (unsigned *)((char *)ring.sq_ptr + p.sq_off.head);
+    ring.sq_tail = (unsigned *)((char *)ring.sq_ptr + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+    ring.sq_entries = (unsigned *)((char *)ring.sq_ptr + p.sq_off.ring_entries);
+    ring.sq_array = (unsigned *)((char *)ring.sq_ptr + p.sq_off.array);
+    ring.cq_head = (unsigned *)((char *)ring.cq_ptr + p.cq_off.head);
+    ring.cq_tail = (unsigned *)((char *)ring.cq_ptr + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ptr + p.cq_off.cqes);
+    ring.sq_tail_local = *ring.sq_tail;
+
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_EVENTFD, &done_efd, 1) < 0) {
+        SLOG("Failed registering the io_uring eventfd, errno %d", errno);
+        goto fail;
+    }
+
+    return TINYEV_ERR_OK;
+
+fail:
+    uring_unmap();
+    return TINYEV_ERR_INIT;
+}
+
+static void flush_cb(void *unused);
+
+/* Hand what was filled in to the kernel. */
+static void uring_submit()
+{
+    int ret;
+
+    __atomic_store_n(ring.sq_tail, ring.sq_tail_local, __ATOMIC_RELEASE);
+
+    while (ring.to_submit) {
+        ret = sys_io_uring_enter(ring.fd, ring.to_submit, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            /* Out of resources, already published, tried again next iteration. */
+            SLOG("io_uring_enter failed, errno %d", errno);
+            if (!flush_queued && !tinyev_defer(flush_cb, NULL))
+                flush_queued = true;
+            return;
+        }
+        ring.to_submit -= ret;
+    }
+}
+
+/* Fill one SQE, false while the ring is full. */
+static bool uring_queue(struct file_op *op)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head, idx;
+
+    head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (ring.sq_tail_local - head >= *ring.sq_entries)
+        return false;
+
+    idx = ring.sq_tail_local & *ring.sq_mask;
+    sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+
+    switch (op->type) {
+    case FILE_OP_READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uint64_t)(uintptr_t)op->buf;
+        sqe->len = op->len > URING_MAX_LEN ? URING_MAX_LEN : op->len;
+        sqe->off = op->off;
+        break;
+    case FILE_OP_WRITE:
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (uint64_t)(uintptr_t)op->buf;
+        sqe->len = op->len > URING_MAX_LEN ? URING_MAX_LEN : op->len;
+        sqe->off = op->off;
+        break;
+    case FILE_OP_FSYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = op->datasync ? IORING_FSYNC_DATASYNC : 0;
+        break;
+    }
+
+    ring.sq_array[idx] = idx;
+    ring.sq_tail_local++;
+    ring.to_submit++;
+
+    return true;
+}
+
+static void uring_reap()
+{
+    struct io_uring_cqe *cqe;
+    struct file_op *op;
+    unsigned head, tail;
+
+    head = *ring.cq_head;
+    while (1) {
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) break;
+
+        cqe = &ring.cqes[head & *ring.cq_mask];
+        op = (struct file_op *)(uintptr_t)cqe->user_data;
+        head++;
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        op_complete(op, cqe->res);
+    }
+}
+
+static void *pool_main(void *unused)
+{
+    struct file_op *op;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (!pool_todo && !pool_stop)
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        if (pool_stop) break;
+
+        op = pool_todo;
+        pool_todo = op->next;
+        if (!pool_todo)
+            pool_todo_tail = NULL;
+        pthread_mutex_unlock(&pool_lock);
+
+        switch (op->type) {
+        case FILE_OP_READ:
+            op->res = pread(op->fd, op->buf, op->len, op->off);
+            break;
+        case FILE_OP_WRITE:
+            op->res = pwrite(op->fd, op->buf, op->len, op->off);
+            break;
+        case FILE_OP_FSYNC:
+            op->res = op->datasync ? fdatasync(op->fd) : fsync(op->fd);
+            break;
+        }
+        if (op->res < 0)
+            op->res = -errno;
+
+        pthread_mutex_lock(&pool_lock);
+        op->next = pool_done;
+        pool_done = op;
+        if (write(done_efd, &one, sizeof(one)) != sizeof(one))
+            SLOG("Failed waking the loop, errno %d", errno);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    return NULL;
+}
+
+static int pool_start()
+{
+    sigset_t all, old;
+
+    /* Signals are for the loop's signalfd, the threads inherit the mask. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pool_stop = false;
+    while (pool_nthreads < FILE_THREADS &&
+           !pthread_create(&pool_threads[pool_nthreads], NULL, pool_main, NULL))
+        pool_nthreads++;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!pool_nthreads) {
+        SLOG("Failed starting file threads");
+        return TINYEV_ERR_INIT;
+    }
+
+    return TINYEV_ERR_OK;
+}
+
+/* Submit everything issued in this iteration at once. */
+static void flush_cb(void *unused)
+{
+    struct file_op *op;
+
+    flush_queued = false;
+
+    if (backend == TINYEV_FILE_URING) {
+        while ((op = batch)) {
+            if (!uring_queue(op)) {
+                /* Full, make room and carry on. */
+                uring_submit();
+                if (!uring_queue(op)) break;
+            }
+            batch = op->next;
+        }
+        if (!batch)
+            batch_tail = NULL;
+        uring_submit();
+        /* Ring still full, the rest goes with the next flush. */
+        if (batch && !flush_queued && !tinyev_defer(flush_cb, NULL))
+            flush_queued = true;
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_todo_tail)
+        pool_todo_tail->next = batch;
+    else
+        pool_todo = batch;
+    pool_todo_tail = batch_tail;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    batch = batch_tail = NULL;
+}
+
+static void done_cb(void *unused)
+{
+    struct file_op *list, *op;
+    uint64_t count;
+
+    if (read(done_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        SLOG("Failed reading the completion eventfd, errno %d", errno);
+
+    if (backend == TINYEV_FILE_URING) {
+        uring_reap();
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    list = pool_done;
+    pool_done = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    while ((op = list)) {
+        list = op->next;
+        op_complete(op, op->res);
+    }
+}
+
+static int file_issue(enum file_op_type type, int fd, void *buf, size_t len, off_t off,
+                      bool datasync, tinyev_file_cb cb, void *data)
+{
+    struct file_op *op;
+
+    if (backend == TINYEV_FILE_AUTO) return TINYEV_ERR_INIT;
+
+    op = op_get();
+    if (!op) return TINYEV_ERR_MEM;
+
+    op->type = type;
+    op->fd = fd;
+    op->buf = buf;
+    op->len = len;
+    op->off = off;
+    op->datasync = datasync;
+    op->cb = cb;
+    op->data = data;
+
+    if (batch_tail)
+        batch_tail->next = op;
+    else
+        batch = op;
+    batch_tail = op;
+
+    if (!flush_queued) {
+        if (tinyev_defer(flush_cb, NULL)) {
+            flush_cb(NULL);
+            return TINYEV_ERR_OK;
+        }
+        flush_queued = true;
+    }
+
+    return TINYEV_ERR_OK;
+}
+
+int tinyev_file_init(enum tinyev_file_backend wanted)
+{
+    int err;
+
+    if (backend != TINYEV_FILE_AUTO) return TINYEV_ERR_OK;
+
+    done_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (done_efd < 0) {
+        SLOG("Failed creating the completion eventfd");
+        return TINYEV_ERR_INIT;
+    }
+
+    if (wanted != TINYEV_FILE_THREADS && uring_setup() == TINYEV_ERR_OK) {
+        backend = TINYEV_FILE_URING;
+    } else if (wanted != TINYEV_FILE_URING && pool_start() == TINYEV_ERR_OK) {
+        backend = TINYEV_FILE_THREADS;
+    } else {
+        close(done_efd);
+        done_efd = -1;
+        return TINYEV_ERR_INIT;
+    }
+
+    done_tev = tinyev_add_fd(done_efd, NULL, done_cb, TEV_RECV | TEV_INTERNAL, &err);
+    if (!done_tev) {
+        tinyev_file_cleanup();
+        return err;
+    }
+
+    SLOG("File I/O on %s", backend == TINYEV_FILE_URING ? "io_uring" : "threads");
+
+    return TINYEV_ERR_OK;
+}
+
+enum tinyev_file_backend tinyev_file_backend()
+{
+    return backend;
+}
+
+int tinyev_file_read(int fd, void *buf, size_t len, off_t off, tinyev_file_cb cb, void *data)
+{
+    return file_issue(FILE_OP_READ, fd, buf, len, off, false, cb, data);
+}
+
+int tinyev_file_write(int fd, const void *buf, size_t len, off_t off, tinyev_file_cb cb, void *data)
+{
+    return file_issue(FILE_OP_WRITE, fd, (void *)buf, len, off, false, cb, data);
+}
+
+int tinyev_file_fsync(int fd, bool datasync, tinyev_file_cb cb, void *data)
+{
+    return file_issue(FILE_OP_FSYNC, fd, NULL, 0, 0, datasync, cb, data);
+}
+
+static int abuf_class(size_t size)
+{
+    int cls = 0;
+
+    while (cls < ABUF_CLASSES && ((size_t)TINYEV_FILE_ALIGN << cls) < size)
+        cls++;
+
+    return cls;
+}
+
+int tinyev_file_buf_alloc(size_t size, struct tinyev_buf *buf)
+{
+    int cls = abuf_class(size);
+
+    buf->len = cls < ABUF_CLASSES ? (size_t)TINYEV_FILE_ALIGN << cls :
+               (size + TINYEV_FILE_ALIGN - 1) & ~((size_t)TINYEV_FILE_ALIGN - 1);
+
+    /* A free buffer keeps the link in its first bytes. */
+    if (cls < ABUF_CLASSES && abuf_free[cls]) {
+        buf->base = abuf_free[cls];
+        abuf_free[cls] = *(void **)buf->base;
+        return TINYEV_ERR_OK;
+    }
+
+    buf->base = aligned_alloc(TINYEV_FILE_ALIGN, buf->len);
+    if (!buf->base) {
+        SLOG("Failed allocating an aligned buffer");
+        buf->len = 0;
+        return TINYEV_ERR_MEM;
+    }
+
+    return TINYEV_ERR_OK;
+}
+
+void tinyev_file_buf_free(struct tinyev_buf *buf)
+{
+    int cls;
+
+    if (!buf->base) return;
+
+    cls = abuf_class(buf->len);
+    if (cls < ABUF_CLASSES && ((size_t)TINYEV_FILE_ALIGN << cls) == buf->len) {
+        *(void **)buf->base = abuf_free[cls];
+        abuf_free[cls] = buf->base;
+    } else {
+        free(buf->base);
+    }
+
+    buf->base = NULL;
+}
+
+void tinyev_file_cleanup()
+{
+    struct file_op *op;
+    void *next;
+    int i;
+
+    if (pool_nthreads) {
+        pthread_mutex_lock(&pool_lock);
+        pool_stop = true;
+        pthread_cond_broadcast(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+
+        for (i = 0; i < pool_nthreads; i++)
+            pthread_join(pool_threads[i], NULL);
+        pool_nthreads = 0;
+
+        /* Ops go back to the free list, never released on their own. */
+        while ((op = pool_todo)) {
+            pool_todo = op->next;
+            op_put(op);
+        }
+        while ((op = pool_done)) {
+            pool_done = op->next;
+            op_put(op);
+        }
+        pool_todo_tail = NULL;
+    }
+
+    if (ring.fd != -1)
+        uring_unmap();
+
+    while ((op = batch)) {
+        batch = op->next;
+        op_put(op);
+    }
+    batch_tail = NULL;
+
+    if (done_tev) {
+        tinyev_remove_fd(done_efd, done_tev);
+        done_tev = NULL;
+    } else if (done_efd != -1) {
+        close(done_efd);
+    }
+    done_efd = -1;
+
+    for (i = 0; i < ABUF_CLASSES; i++) {
+        while (abuf_free[i]) {
+            next = *(void **)abuf_free[i];
+            free(abuf_free[i]);
+            abuf_free[i] = next;
+        }
+    }
+
+    backend = TINYEV_FILE_AUTO;
+}
@@ -0,0 +1,404 @@
+/**
+ * @file tinyev_frame.c
+ * @brief cuts a byte stream into frames: delimited, length prefixed or
+ * fixed size. Frames that came in one read are handed to the user straight
+ * from the read buffer, only frames split over reads are copied aside.
+ * The delimiter search uses SSE2 or AVX2 when the CPU has them.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#   include <immintrin.h>
+#   define FRAME_X86
+#endif
+
+#include "log.h"
+#include "tinyev_frame.h"
+
+/* Defines. */
+#define DEFAULT_MAX_FRAME (64 * 1024)
+
+/* Structures. */
+typedef const char *(*find_fn)(const char *p, size_t n, char c);
+
+struct tinyev_framer {
+    struct tinyev_frame_opts opts;
+    tinyev_frame_cb cb;
+    void *data;
+    void *tev;                          // Set when tinyev reads the fd
+    uint32_t hdr;                       // Length prefix size
+    char *partial;                      // Frame split over reads
+    size_t plen;
+    size_t pcap;
+    int depth;                          // Nested feeds running
+    bool freed;                         // Released from a callback
+    bool failed;                        // Stream is broken, ignore the rest
+};
+
+/* ==*== GLOBAL VARIABLES ==*== */
+
+static find_fn find_delim = NULL;
+static enum tinyev_simd simd_level = TINYEV_SIMD_AUTO;
+
+static const char *find_scalar(const char *p, size_t n, char c)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (p[i] == c)
+            return p + i;
+    }
+
+    return NULL;
+}
+
+#ifdef FRAME_X86
+__attribute__((target("sse2")))
+static const char *find_sse2(const char *p, size_t n, char c)
+{
+    __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    int mask;
+
+    for (; i + 16 <= n; i += 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), needle));
+        if (mask)
+            return p + i + __builtin_ctz(mask);
+    }
+
+    return find_scalar(p + i, n - i, c);
+}
+
+/* Two vectors per round, one branch for both. */
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *p, size_t n, char c)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+    __m256i a, b;
+    size_t i = 0;
+    uint32_t mask;
+
+    for (; i + 64 <= n; i += 64) {
+        a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), needle);
+        b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), needle);
+        if (_mm256_movemask_epi8(_mm256_or_si256(a, b))) {
+            mask = _mm256_movemask_epi8(a);
+            if (mask)
+                return p + i + __builtin_ctz(mask);
+            return p + i + 32 + __builtin_ctz(_mm256_movemask_epi8(b));
+        }
+    }
+
+    for (; i + 32 <= n; i += 32) {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), needle));
+        if (mask)
+            return p + i + __builtin_ctz(mask);
+    }
+
+    return find_sse2(p + i, n - i, c);
+}
+#endif
+
+enum tinyev_simd tinyev_frame_simd(enum tinyev_simd level)
+{
+#ifdef FRAME_X86
+    __builtin_cpu_init();
+    if (level == TINYEV_SIMD_AUTO || level == TINYEV_SIMD_AVX2)
+        level = __builtin_cpu_supports("avx2") ? TINYEV_SIMD_AVX2 : TINYEV_SIMD_SSE2;
+    if (level == TINYEV_SIMD_SSE2 && !__builtin_cpu_supports("sse2"))
+        level = TINYEV_SIMD_SCALAR;
+#else
+    level = TINYEV_SIMD_SCALAR;
+#endif
+
+    switch (level) {
+#ifdef FRAME_X86
+    case TINYEV_SIMD_AVX2:
+        find_delim = find_avx2;
+        break;
+    case TINYEV_SIMD_SSE2:
+        find_delim = find_sse2;
+        break;
+#endif
+    default:
+        find_delim = find_scalar;
+        break;
+    }
+
+    SLOG("Delimiter search level %d", level);
+    simd_level = level;
+
+    return simd_level;
+}
+
+/* Size of the frame at p including its prefix, 0 while the prefix is
+    incomplete. */
+static size_t frame_total(struct tinyev_framer *f, const char *p, size_t n)
+{
+    const unsigned char *u = (const unsigned char *)p;
+
+    switch (f->opts.mode) {
+    case TINYEV_FRAME_U16:
+        if (n < 2) return 0;
+        return 2 + (f->opts.little_endian ? (u[0] | u[1] << 8) : (u[0] << 8 | u[1]));
+    case TINYEV_FRAME_U32:
+        if (n < 4) return 0;
+        return 4 + (size_t)(f->opts.little_endian ?
+                            ((uint32_t)u[0] | (uint32_t)u[1] << 8 | (uint32_t)u[2] << 16 | (uint32_t)u[3] << 24) :
+                            ((uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | (uint32_t)u[3]));
+    default:
+        return f->opts.size;
+    }
+}
+
+static void frame_fail(struct tinyev_framer *f, ssize_t err)
+{
+    f->failed = true;
+    f->plen = 0;
+    f->cb(f->data, NULL, err);
+}
+
+/* Hand over the frame without its prefix or delimiter. */
+static void frame_deliver(struct tinyev_framer *f, const char *p, size_t total)
+{
+    if (f->opts.mode == TINYEV_FRAME_DELIM)
+        f->cb(f->data, p, total - 1);
+    else
+        f->cb(f->data, p + f->hdr, total - f->hdr);
+}
+
+static int partial_append(struct tinyev_framer *f, const char *p, size_t n)
+{
+    size_t cap = f->pcap ? f->pcap : 256;
+    char *tmp;
+
+    while (cap < f->plen + n) cap *= 2;
+    if (cap != f->pcap) {
+        tmp = realloc(f->partial, cap);
+        if (!tmp) return TINYEV_ERR_MEM;
+        f->partial = tmp;
+        f->pcap = cap;
+    }
+
+    memcpy(f->partial + f->plen, p, n);
+    f->plen += n;
+
+    return TINYEV_ERR_OK;
+}
+
+/* Complete the frame kept aside with the start of p. Returns how much of
+    p was used, or -1 on error. */
+static ssize_t finish_partial(struct tinyev_framer *f, const char *p, size_t n)
+{
+    const char *q;
+    size_t total, take, used = 0;
+
+    if (f->opts.mode == TINYEV_FRAME_DELIM) {
+        q = find_delim(p, n, f->opts.delim);
+        take = q ? (size_t)(q - p) + 1 : n;
+        if (f->plen + take > f->opts.max_frame + 1) {
+            frame_fail(f, -EMSGSIZE);
+            return -1;
+        }
+        if (partial_append(f, p, take)) return -1;
+        if (q) {
+            frame_deliver(f, f->partial, f->plen);
+            f->plen = 0;
+        }
+        return take;
+    }
+
+    /* Prefix first, then the rest of the frame. */
+    total = frame_total(f, f->partial, f->plen);
+    if (!total) {
+        take = f->hdr - f->plen < n ? f->hdr - f->plen : n;
+        if (partial_append(f, p, take)) return -1;
+        used = take;
+        total = frame_total(f, f->partial, f->plen);
+        if (!total) return used;
+        if (total > f->opts.max_frame + f->hdr) {
+            frame_fail(f, -EMSGSIZE);
+            return -1;
+        }
+    }
+
+    take = total - f->plen < n - used ? total - f->plen : n - used;
+    if (partial_append(f, p + used, take)) return -1;
+    used += take;
+    if (f->plen == total) {
+        frame_deliver(f, f->partial, total);
+        f->plen = 0;
+    }
+
+    return used;
+}
+
+int tinyev_frame_feed(void *fr, const char *buf, size_t len)
+{
+    struct tinyev_framer *f = fr;
+    const char *p = buf, *q;
+    size_t n = len, total;
+    ssize_t used;
+    int err = TINYEV_ERR_OK;
+
+    if (f->failed || f->freed) return TINYEV_ERR_OK;
+
+    f->depth++;
+
+    if (f->plen) {
+        used = finish_partial(f, p, n);
+        if (used < 0) {
+            if (!f->failed) err = TINYEV_ERR_MEM;
+            goto out;
+        }
+        p += used;
+        n -= used;
+    }
+
+    /* Straight from the caller's buffer. */
+    while (n && !f->freed && !f->failed) {
+        if (f->opts.mode == TINYEV_FRAME_DELIM) {
+            q = find_delim(p, n, f->opts.delim);
+            if (!q) break;
+            total = q - p + 1;
+            if (total > f->opts.max_frame + 1) {
+                frame_fail(f, -EMSGSIZE);
+                goto out;
+            }
+        } else {
+            total = frame_total(f, p, n);
+            if (total > f->opts.max_frame + f->hdr) {
+                frame_fail(f, -EMSGSIZE);
+                goto out;
+            }
+            if (!total || total > n) break;
+        }
+
+        frame_deliver(f, p, total);
+        p += total;
+        n -= total;
+    }
+
+    if (n && !f->freed && !f->failed) {
+        if (f->opts.mode == TINYEV_FRAME_DELIM && n > f->opts.max_frame) {
+            frame_fail(f, -EMSGSIZE);
+            goto out;
+        }
+        err = partial_append(f, p, n);
+    }
+
+out:
+    f->depth--;
+    if (f->freed && !f->depth) {
+        free(f->partial);
+        free(f);
+    }
+
+    return err;
+}
+
+void *tinyev_frame_new(const struct tinyev_frame_opts *opts, tinyev_frame_cb cb, void *data)
+{
+    struct tinyev_framer *f = calloc(1, sizeof(struct tinyev_framer));
+
+    if (!f) {
+        SLOG("Failed allocating framer");
+        return NULL;
+    }
+
+    if (!find_delim)
+        tinyev_frame_simd(TINYEV_SIMD_AUTO);
+
+    f->opts = *opts;
+    if (!f->opts.max_frame)
+        f->opts.max_frame = DEFAULT_MAX_FRAME;
+    f->cb = cb;
+    f->data = data;
+
+    switch (f->opts.mode) {
+    case TINYEV_FRAME_U16:
+        f->hdr = 2;
+        break;
+    case TINYEV_FRAME_U32:
+        f->hdr = 4;
+        break;
+    case TINYEV_FRAME_FIXED:
+        if (!f->opts.size) f->opts.size = 1;
+        if (f->opts.max_frame < f->opts.size) f->opts.max_frame = f->opts.size;
+        break;
+    default:
+        break;
+    }
+
+    return f;
+}
+
+void tinyev_frame_free(void *fr)
+{
+    struct tinyev_framer *f = fr;
+
+    if (!f) return;
+
+    if (f->depth) {
+        /* tinyev_frame_feed() releases it on the way out. */
+        f->freed = true;
+        return;
+    }
+
+    free(f->partial);
+    free(f);
+}
+
+static void framed_read_cb(void *udata, ssize_t nread, struct tinyev_buf *buf)
+{
+    struct tinyev_framer *f = udata;
+
+    if (nread > 0) {
+        if (tinyev_frame_feed(f, buf->base, nread))
+            frame_fail(f, -ENOMEM);
+    } else if (nread < 0 && !f->failed) {
+        frame_fail(f, nread);
+    }
+
+    tinyev_buf_free(buf);
+}
+
+void *tinyev_add_framed(int fd, const struct tinyev_frame_opts *opts, tinyev_frame_cb cb,
+                        void *data, int *err)
+{
+    struct tinyev_framer *f = tinyev_frame_new(opts, cb, data);
+
+    if (!f) {
+        *err = TINYEV_ERR_MEM;
+        return NULL;
+    }
+
+    f->tev = tinyev_add_reader(fd, f, 0, NULL, framed_read_cb, err);
+    if (!f->tev) {
+        tinyev_frame_free(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+void tinyev_remove_framed(int fd, void *fr)
+{
+    struct tinyev_framer *f = fr;
+
+    if (!f) return;
+
+    tinyev_remove_fd(fd, f->tev);
+    f->tev = NULL;
+    tinyev_frame_free(f);
+}
+
+void *tinyev_frame_evobj(void *fr)
+{
+    return ((struct tinyev_framer *)fr)->tev;
+}
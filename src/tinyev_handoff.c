@@ -0,0 +1,255 @@
+/**
+ * @file tinyev_handoff.c
+ * @brief passes listening sockets and live connections to a new process
+ * over a unix socket with SCM_RIGHTS, for restarts without dropping the
+ * listen backlog or warm connections.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "tinyev_handoff.h"
+
+/* Defines. */
+#define HANDOFF_MAGIC 0x74657668        // "tevh"
+#define HANDOFF_BATCH 250               // fds per message, SCM_MAX_FD is 253
+#define HANDOFF_ACK_SEC 5               // Wait for the new process this long
+
+/* Structures. */
+struct handoff_entry {
+    uint64_t tag;
+    uint32_t flags;
+    uint32_t pad;
+};
+
+/* One seqpacket message, the fds ride along in the control data. */
+struct handoff_msg {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t last;
+    struct handoff_entry entries[HANDOFF_BATCH];
+};
+
+static int unix_addr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        SLOG("Handoff path too long");
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+static int send_batch(int sock, const struct tinyev_handoff_fd *fds, int n, bool last)
+{
+    struct handoff_msg msg;
+    char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    struct msghdr mh = {0};
+    struct iovec iov;
+    struct cmsghdr *cm;
+    int *cfds, i, listening;
+    socklen_t len;
+
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.magic = HANDOFF_MAGIC;
+    msg.count = n;
+    msg.last = last;
+
+    for (i = 0; i < n; i++) {
+        msg.entries[i].tag = fds[i].tag;
+        msg.entries[i].flags = fds[i].flags & ~TINYEV_HANDOFF_LISTENER;
+        msg.entries[i].pad = 0;
+
+        listening = 0;
+        len = sizeof(listening);
+        if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 && listening)
+            msg.entries[i].flags |= TINYEV_HANDOFF_LISTENER;
+    }
+
+    iov.iov_base = &msg;
+    iov.iov_len = offsetof(struct handoff_msg, entries) + n * sizeof(struct handoff_entry);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (n) {
+        mh.msg_control = cbuf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        cfds = (int *)CMSG_DATA(cm);
+        for (i = 0; i < n; i++)
+            cfds[i] = fds[i].fd;
+    }
+
+    if (sendmsg(sock, &mh, MSG_NOSIGNAL) < 0) {
+        SLOG("Handoff sendmsg failed, errno %d", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int tinyev_handoff_send(const char *path, const struct tinyev_handoff_fd *fds, int n)
+{
+    struct sockaddr_un addr;
+    struct timeval tv = {.tv_sec = HANDOFF_ACK_SEC};
+    int sock, sent = 0, batch;
+    char ack;
+
+    if (unix_addr(path, &addr) < 0) return TINYEV_ERR_HANDOFF;
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) return TINYEV_ERR_HANDOFF;
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        SLOG("Nobody waits on %s", path);
+        goto err;
+    }
+
+    do {
+        batch = n - sent < HANDOFF_BATCH ? n - sent : HANDOFF_BATCH;
+        if (send_batch(sock, fds + sent, batch, sent + batch == n) < 0)
+            goto err;
+        sent += batch;
+    } while (sent < n);
+
+    /* Only let go of the fds once the new process has them. */
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (recv(sock, &ack, 1, 0) != 1) {
+        SLOG("No handoff ack");
+        goto err;
+    }
+
+    close(sock);
+    SLOG("Handed off %d fds", n);
+
+    return TINYEV_ERR_OK;
+
+err:
+    close(sock);
+    return TINYEV_ERR_HANDOFF;
+}
+
+/* Returns 1 on the last message, 0 for more to come, -1 on error. */
+static int recv_batch(int sock, struct tinyev_handoff_fd *fds, int max, int *got)
+{
+    struct handoff_msg msg;
+    char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    struct msghdr mh = {0};
+    struct iovec iov;
+    struct cmsghdr *cm;
+    int *cfds = NULL, nfds = 0, i;
+    ssize_t bytes;
+    size_t want;
+
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+
+    bytes = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    if (bytes < (ssize_t)offsetof(struct handoff_msg, entries))
+        return -1;
+
+    for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            cfds = (int *)CMSG_DATA(cm);
+            nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        }
+    }
+
+    /* Exactly count entries, the rest of msg is stack garbage. */
+    want = offsetof(struct handoff_msg, entries) + msg.count * sizeof(struct handoff_entry);
+    if (msg.magic != HANDOFF_MAGIC || msg.count > HANDOFF_BATCH || nfds != msg.count ||
+        bytes != (ssize_t)want || (mh.msg_flags & (MSG_CTRUNC | MSG_TRUNC))) {
+        SLOG("Bad handoff message");
+        for (i = 0; i < nfds; i++)
+            close(cfds[i]);
+        return -1;
+    }
+
+    for (i = 0; i < nfds; i++) {
+        if (*got == max) {
+            close(cfds[i]);
+            continue;
+        }
+        fds[*got].fd = cfds[i];
+        fds[*got].tag = msg.entries[i].tag;
+        fds[*got].flags = msg.entries[i].flags;
+        (*got)++;
+    }
+
+    return msg.last ? 1 : 0;
+}
+
+int tinyev_handoff_recv(const char *path, struct tinyev_handoff_fd *fds, int max, int timeout_msec)
+{
+    struct sockaddr_un addr;
+    struct pollfd pfd;
+    int ls, sock = -1, got = 0, rc, i;
+    char ack = 1;
+
+    if (unix_addr(path, &addr) < 0) return -1;
+
+    ls = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (ls < 0) return -1;
+
+    unlink(path);
+    if (bind(ls, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(ls, 1) < 0) {
+        SLOG("Failed listening on %s", path);
+        goto out;
+    }
+
+    pfd.fd = ls;
+    pfd.events = POLLIN;
+    do {
+        rc = poll(&pfd, 1, timeout_msec);
+    } while (rc < 0 && errno == EINTR);
+    if (rc <= 0) {
+        SLOG("No handoff within %d msec", timeout_msec);
+        goto out;
+    }
+
+    sock = accept(ls, NULL, NULL);
+    if (sock < 0) goto out;
+
+    while ((rc = recv_batch(sock, fds, max, &got)) == 0)
+        ;
+
+    if (rc < 0 || send(sock, &ack, 1, MSG_NOSIGNAL) != 1) {
+        /* The old process keeps serving, drop our copies. */
+        for (i = 0; i < got; i++)
+            close(fds[i].fd);
+        got = 0;
+        goto out;
+    }
+
+    close(sock);
+    close(ls);
+    unlink(path);
+
+    return got;
+
+out:
+    if (sock >= 0) close(sock);
+    close(ls);
+    unlink(path);
+    return -1;
+}
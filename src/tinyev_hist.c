@@ -0,0 +1,91 @@
+/**
+ * @file tinyev_hist.c
+ * @brief log-linear latency histogram, fixed size and allocation free so
+ * it can be recorded into from the hot path.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <string.h>
+
+#include "tinyev_hist.h"
+
+/* Defines. */
+#define SUB_COUNT (1 << TINYEV_HIST_SUB_BITS)
+#define HALF_COUNT (SUB_COUNT / 2)
+
+static uint32_t hist_index(uint64_t value)
+{
+    uint32_t shift;
+
+    if (value < SUB_COUNT)
+        return value;
+
+    /* Keep the top TINYEV_HIST_SUB_BITS bits of the value. */
+    shift = 63 - __builtin_clzll(value) - TINYEV_HIST_SUB_BITS + 1;
+
+    return SUB_COUNT + (shift - 1) * HALF_COUNT + ((value >> shift) - HALF_COUNT);
+}
+
+/* Highest value that lands in the bucket. */
+static uint64_t hist_value(uint32_t idx)
+{
+    uint32_t shift;
+    uint64_t top;
+
+    if (idx < SUB_COUNT)
+        return idx;
+
+    shift = (idx - SUB_COUNT) / HALF_COUNT + 1;
+    top = (idx - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+
+    return ((top + 1) << shift) - 1;
+}
+
+void tinyev_hist_reset(struct tinyev_hist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void tinyev_hist_record(struct tinyev_hist *h, uint64_t value)
+{
+    h->counts[hist_index(value)]++;
+    h->total++;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+void tinyev_hist_merge(struct tinyev_hist *dst, const struct tinyev_hist *src)
+{
+    uint32_t i;
+
+    for (i = 0; i < TINYEV_HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+
+    dst->total += src->total;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t tinyev_hist_percentile(const struct tinyev_hist *h, double pct)
+{
+    uint64_t want, seen = 0, value;
+    uint32_t i;
+
+    if (!h->total) return 0;
+
+    want = (uint64_t)(pct / 100.0 * h->total + 0.5);
+    if (want < 1) want = 1;
+    if (want > h->total) want = h->total;
+
+    for (i = 0; i < TINYEV_HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            value = hist_value(i);
+            return value > h->max ? h->max : value;
+        }
+    }
+
+    return h->max;
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "tinyev.h"
+
+#define DEFAULT_CONNS 500000
+#define BUF_SIZE 16384
+
+struct conn {
+    int fd;
+    void *tev;
+    char *buf;                  // Own buffer mode only
+    size_t got;
+};
+
+static struct conn *conns;
+static int finished = 0;
+static const char msg[BUF_SIZE];
+
+static long rss_bytes()
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void got_bytes(struct conn *c, ssize_t bytes)
+{
+    c->got += bytes;
+    if (c->got == BUF_SIZE)
+        finished++;
+}
+
+/* Every connection owns a buffer, like tests/test_server.c. */
+static void own_cb(void *udata)
+{
+    struct conn *c = udata;
+    ssize_t bytes;
+
+    if (!c->buf)
+        c->buf = malloc(BUF_SIZE);
+
+    bytes = read(c->fd, c->buf, BUF_SIZE);
+    if (bytes > 0)
+        got_bytes(c, bytes);
+}
+
+/* The data is consumed right away, the buffer goes back to the pool. */
+static void pool_cb(void *udata, ssize_t nread, struct tinyev_buf *buf)
+{
+    if (nread > 0)
+        got_bytes(udata, nread);
+
+    tinyev_buf_free(buf);
+}
+
+static void run(int n, bool pool)
+{
+    size_t mapped, in_use;
+    long rss_before, rss_after;
+    int pair[2];
+    int i, err;
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        exit(EXIT_FAILURE);
+    }
+
+    conns = calloc(n, sizeof(struct conn));
+    rss_before = rss_bytes();
+
+    for (i = 0; i < n; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+            printf("socketpair failed after %d pairs\n", i);
+            exit(EXIT_FAILURE);
+        }
+        conns[i].fd = pair[0];
+        if (pool)
+            conns[i].tev = tinyev_add_reader(pair[0], &conns[i], BUF_SIZE, NULL, pool_cb, &err);
+        else
+            conns[i].tev = tinyev_add_fd(pair[0], &conns[i], own_cb, TEV_RECV, &err);
+        if (!conns[i].tev) {
+            printf("Failed to add fd, err %d\n", err);
+            exit(EXIT_FAILURE);
+        }
+
+        /* One full buffer of traffic, then the connection goes idle. */
+        if (write(pair[1], msg, BUF_SIZE) != BUF_SIZE) {
+            printf("Failed to send\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while (finished < n)
+        tinyev_poll(200);
+
+    rss_after = rss_bytes();
+    tinyev_buf_pool_usage(&mapped, &in_use);
+
+    printf("%s: %d idle conns, %.0f bytes RSS per conn, pool mapped %zu KB\n",
+           pool ? "shared pool " : "own buffers", n,
+           (double)(rss_after - rss_before) / n, mapped / 1024);
+
+    tinyev_cleanup();
+}
+
+int main(int argc, char *argv[])
+{
+    struct rlimit rl;
+    int n = DEFAULT_CONNS;
+    int i;
+
+    if (argc > 1) n = atoi(argv[1]);
+
+    /* Every connection is a pair of fds. */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur != RLIM_INFINITY && (rlim_t)n > rl.rlim_cur / 2 - 16) {
+            n = rl.rlim_cur / 2 - 16;
+            printf("fd limit, using %d conns\n", n);
+        }
+    }
+
+    /* Fresh process per run. */
+    for (i = 0; i < 2; i++) {
+        fflush(stdout);
+        if (fork() == 0) {
+            run(n, i == 1);
+            exit(EXIT_SUCCESS);
+        }
+        wait(NULL);
+    }
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "tinyev.h"
+#include "tinyev_co.h"
+
+#define SWITCHES 10000000
+#define DEFAULT_COROUTINES 100000
+#define ROUNDS 10
+#define MSG "ping"
+
+static int done_clients = 0;
+static long switches_left = SWITCHES;
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void switch_co(void *udata)
+{
+    void **self = udata;
+
+    *self = tinyev_co_self();
+    while (switches_left--) {
+        tinyev_co_suspend();
+    }
+}
+
+static void echo_co(void *udata)
+{
+    int fd = (int)(long)udata;
+    char buf[64];
+    ssize_t bytes;
+
+    while ((bytes = tinyev_co_read(fd, buf, sizeof(buf))) > 0) {
+        if (tinyev_co_write(fd, buf, bytes) < 0)
+            break;
+    }
+
+    tinyev_co_close(fd);
+}
+
+static void client_co(void *udata)
+{
+    int fd = (int)(long)udata;
+    char buf[64];
+    int i;
+
+    for (i = 0; i < ROUNDS; i++) {
+        if (tinyev_co_write(fd, MSG, sizeof(MSG)) < 0)
+            break;
+        if (tinyev_co_read(fd, buf, sizeof(buf)) <= 0)
+            break;
+    }
+
+    tinyev_co_close(fd);
+    done_clients++;
+}
+
+static void bench_switch()
+{
+    void *co = NULL;
+    double start, elapsed;
+    long i;
+
+    /* Runs until the first suspend. */
+    tinyev_co_spawn(switch_co, &co);
+
+    start = now_sec();
+    for (i = 0; i < SWITCHES; i++) {
+        tinyev_co_resume(co);
+    }
+    elapsed = now_sec() - start;
+
+    /* Resume + suspend per round. */
+    printf("switch: %d round trips in %.3f sec, %.1f ns per switch\n",
+           SWITCHES, elapsed, elapsed * 1e9 / (2.0 * SWITCHES));
+}
+
+int main(int argc, char *argv[])
+{
+    struct rlimit rl;
+    int n = DEFAULT_COROUTINES;
+    int pair[2];
+    int i, pairs = 0;
+    double start, elapsed;
+
+    if (argc > 1) n = atoi(argv[1]);
+
+    /* Every pair is two fds. */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        return -1;
+    }
+
+    bench_switch();
+
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+            printf("socketpair failed after %d pairs, errno %d\n", i, errno);
+            break;
+        }
+        if (tinyev_co_spawn(echo_co, (void *)(long)pair[0]) ||
+            tinyev_co_spawn(client_co, (void *)(long)pair[1])) {
+            printf("spawn failed after %d pairs (check vm.max_map_count)\n", i);
+            break;
+        }
+        pairs++;
+    }
+
+    while (done_clients < pairs) {
+        tinyev_poll(200);
+    }
+    elapsed = now_sec() - start;
+
+    printf("echo: %d connections, %d coroutines, %d round trips in %.3f sec, %.0f rt/s\n",
+           pairs, pairs * 2, pairs * ROUNDS, elapsed, pairs * ROUNDS / elapsed);
+
+    tinyev_co_cleanup();
+    tinyev_cleanup();
+
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tinyev.h"
+#include "tinyev_connect.h"
+
+#define BENCH_PORT 23490
+#define DEAD_PORT 23491             // Nothing listens, refused right away
+#define DEFAULT_CONNS 10000
+#define DEFAULT_INFLIGHT 1000
+#define TIMEOUT_MSEC 5000
+
+static int listen_fd;
+static struct addrinfo *addrs;
+static int total = DEFAULT_CONNS;
+static int inflight = DEFAULT_INFLIGHT;
+static int started = 0, done = 0, failed = 0, accepted = 0;
+static bool by_name = false;
+static char port_str[8];
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reset instead of close, no TIME_WAIT piling up over the runs. */
+static void drop(int fd)
+{
+    struct linger lg = {.l_onoff = 1, .l_linger = 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+}
+
+static void accept_cb(void *udata)
+{
+    int fd;
+
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        accepted++;
+        close(fd);
+    }
+}
+
+static void start_one();
+
+static void connected_cb(void *udata, int fd, int err)
+{
+    done++;
+    if (fd >= 0)
+        drop(fd);
+    else
+        failed++;
+
+    if (started < total)
+        start_one();
+}
+
+static void start_one()
+{
+    int err;
+
+    started++;
+    if (by_name ? !tinyev_connect_host("localhost", port_str, TIMEOUT_MSEC, connected_cb, NULL, &err) :
+                  !tinyev_connect(addrs, TIMEOUT_MSEC, 0, connected_cb, NULL, &err)) {
+        done++;
+        failed++;
+    }
+}
+
+static void run_tinyev(bool name)
+{
+    double start, secs;
+    int i;
+
+    by_name = name;
+    started = done = failed = 0;
+
+    start = now_sec();
+    for (i = 0; i < inflight && started < total; i++)
+        start_one();
+    while (done < total)
+        tinyev_poll(100);
+    secs = now_sec() - start;
+
+    printf("tinyev_connect%s, %d in flight: %.0f conns/s, %d failed\n",
+           name ? " by name" : "        ", inflight, total / secs, failed);
+}
+
+/* What test_client does, the loop would be frozen meanwhile. */
+static void run_blocking()
+{
+    double start, secs;
+    int i, fd, fails = 0;
+
+    start = now_sec();
+    for (i = 0; i < total; i++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, addrs->ai_addr, addrs->ai_addrlen) < 0) {
+            fails++;
+            close(fd);
+            continue;
+        }
+        drop(fd);
+        /* Keep the backlog short. */
+        if (i % 64 == 63) tinyev_poll(0);
+    }
+    secs = now_sec() - start;
+
+    printf("blocking connect, one at a time: %.0f conns/s, %d failed\n", total / secs, fails);
+}
+
+static int race_fd = -1, race_err = 0;
+
+static void race_cb(void *udata, int fd, int err)
+{
+    race_fd = fd;
+    race_err = err;
+}
+
+/* A refused address first, the good one must win without waiting for
+    the stagger. */
+static void run_race()
+{
+    struct sockaddr_in dead = *(struct sockaddr_in *)addrs->ai_addr;
+    struct addrinfo dead_ai = *addrs;
+    double start;
+    int err;
+
+    dead.sin_port = htons(DEAD_PORT);
+    dead_ai.ai_addr = (struct sockaddr *)&dead;
+    dead_ai.ai_next = addrs;
+
+    start = now_sec();
+    if (!tinyev_connect(&dead_ai, TIMEOUT_MSEC, 0, race_cb, NULL, &err)) {
+        printf("race: could not start, err %d\n", err);
+        return;
+    }
+    while (race_fd < 0 && !race_err)
+        tinyev_poll(100);
+
+    printf("race: refused address first, %s in %.2f ms (stagger %d ms)\n",
+           race_fd >= 0 ? "connected" : "failed", (now_sec() - start) * 1e3, TINYEV_CONNECT_STAGGER);
+    if (race_fd >= 0) drop(race_fd);
+}
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints = {0};
+    struct sockaddr_in addr = {0};
+    struct rlimit rl;
+    int one = 1, err;
+
+    if (argc > 1) total = atoi(argv[1]);
+    if (argc > 2) inflight = atoi(argv[2]);
+    if (total < 1 || inflight < 1) {
+        printf("Usage: bench_connect [conns] [in flight]\n");
+        return -1;
+    }
+
+    /* Both ends of every connection in flight are here. */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur != RLIM_INFINITY && (rlim_t)inflight > rl.rlim_cur / 2 - 16) {
+            inflight = rl.rlim_cur / 2 - 16;
+            printf("fd limit, %d in flight\n", inflight);
+        }
+    }
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        return -1;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 4096) < 0) {
+        printf("Cannot listen, errno %d\n", errno);
+        return -1;
+    }
+    tinyev_add_fd(listen_fd, NULL, accept_cb, TEV_RECV, &err);
+
+    snprintf(port_str, sizeof(port_str), "%d", BENCH_PORT);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("127.0.0.1", port_str, &hints, &addrs)) {
+        printf("getaddrinfo failed\n");
+        return -1;
+    }
+
+    printf("%d loopback connections\n", total);
+    run_blocking();
+    run_tinyev(false);
+    run_tinyev(true);
+    run_race();
+
+    freeaddrinfo(addrs);
+    tinyev_connect_cleanup();
+    tinyev_remove_fd(listen_fd, NULL);
+    tinyev_cleanup();
+
+    return 0;
+}
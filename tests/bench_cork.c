@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "tinyev.h"
+#include "tinyev_frame.h"
+
+#define DEFAULT_CONNS 64
+#define DEFAULT_DEPTH 32            // Pipelined requests sent in one write
+#define MAX_DEPTH 256               // Plain responses to more fill the socket
+#define RUN_MSEC 2000
+#define REQ "GET /key\n"
+#define RESP "VALUE 0123456\n"
+#define REQ_LEN (sizeof(REQ) - 1)
+#define RESP_LEN (sizeof(RESP) - 1)
+
+struct conn {
+    int server_fd;
+    void *framer;
+    int client_fd;
+    void *client_tev;
+    size_t rx;                      // Response bytes of the current batch
+};
+
+static struct conn *conns;
+static int nconns = DEFAULT_CONNS;
+static int depth = DEFAULT_DEPTH;
+static char *batch;
+static bool corked;
+static bool stop = false;
+static uint64_t responses = 0, plain_writes = 0;
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void send_batch(struct conn *c)
+{
+    if (write(c->client_fd, batch, REQ_LEN * depth) != (ssize_t)(REQ_LEN * depth))
+        printf("Short batch write\n");
+}
+
+/* Server side, one small response per request. */
+static void frame_cb(void *udata, const char *frame, ssize_t len)
+{
+    struct conn *c = udata;
+
+    if (!frame) return;
+
+    if (corked) {
+        tinyev_write(tinyev_frame_evobj(c->framer), RESP, RESP_LEN);
+    } else {
+        plain_writes++;
+        if (write(c->server_fd, RESP, RESP_LEN) != RESP_LEN)
+            printf("Short write\n");
+    }
+}
+
+/* Client side, the next batch once the whole last one was answered. */
+static void client_cb(void *udata)
+{
+    static char buf[65536];
+    struct conn *c = udata;
+    ssize_t bytes;
+
+    while ((bytes = read(c->client_fd, buf, sizeof(buf))) > 0) {
+        c->rx += bytes;
+        responses += c->rx / RESP_LEN - (c->rx - bytes) / RESP_LEN;
+    }
+
+    if (c->rx == RESP_LEN * depth) {
+        c->rx = 0;
+        if (!stop) send_batch(c);
+    }
+}
+
+static void stop_cb(void *udata)
+{
+    stop = true;
+}
+
+static void run()
+{
+    struct tinyev_frame_opts opts = {.mode = TINYEV_FRAME_DELIM, .delim = '\n'};
+    struct tinyev_stats st;
+    uint64_t syscalls;
+    double start, secs;
+    int pair[2];
+    int i, err;
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        exit(EXIT_FAILURE);
+    }
+
+    conns = calloc(nconns, sizeof(struct conn));
+    for (i = 0; i < nconns; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+            printf("socketpair failed\n");
+            exit(EXIT_FAILURE);
+        }
+        conns[i].server_fd = pair[0];
+        conns[i].client_fd = pair[1];
+        conns[i].framer = tinyev_add_framed(pair[0], &opts, frame_cb, &conns[i], &err);
+        conns[i].client_tev = tinyev_add_fd(pair[1], &conns[i], client_cb, TEV_RECV, &err);
+        if (!conns[i].framer || !conns[i].client_tev) {
+            printf("Failed to add fd, err %d\n", err);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    tinyev_add_timer(0, RUN_MSEC, NULL, stop_cb);
+    start = now_sec();
+    for (i = 0; i < nconns; i++)
+        send_batch(&conns[i]);
+
+    while (!stop)
+        tinyev_poll(100);
+    secs = now_sec() - start;
+
+    tinyev_get_stats(&st);
+    syscalls = corked ? st.write_syscalls : plain_writes;
+    printf("%s: %.0f responses/s, %lu response writes, %.3f per response\n",
+           corked ? "corked" : "plain ", responses / secs, syscalls, (double)syscalls / responses);
+
+    tinyev_cleanup();
+}
+
+int main(int argc, char *argv[])
+{
+    int i;
+
+    if (argc > 1) depth = atoi(argv[1]);
+    if (argc > 2) nconns = atoi(argv[2]);
+    if (depth < 1 || depth > MAX_DEPTH || nconns < 1) {
+        printf("Usage: bench_cork [pipeline depth] [conns]\n");
+        return -1;
+    }
+
+    batch = malloc(REQ_LEN * depth);
+    for (i = 0; i < depth; i++)
+        memcpy(batch + i * REQ_LEN, REQ, REQ_LEN);
+
+    printf("%d conns, %d pipelined %zu byte requests, %zu byte responses\n",
+           nconns, depth, REQ_LEN, RESP_LEN);
+
+    /* Fresh process per mode. */
+    for (i = 0; i < 2; i++) {
+        corked = i == 1;
+        fflush(stdout);
+        if (fork() == 0) {
+            run();
+            exit(EXIT_SUCCESS);
+        }
+        wait(NULL);
+    }
+
+    free(batch);
+
+    return 0;
+}
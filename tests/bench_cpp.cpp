@@ -0,0 +1,150 @@
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "tinyev.hpp"
+
+#define NFDS 512                    // One full epoll batch per poll
+#define POLLS 20000
+#define RUNS 3
+
+struct ctx {
+    uint64_t count;
+};
+
+struct Conn {
+    uint64_t count = 0;
+
+    void on_ready() { count++; }
+};
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Level triggered and never read, so every fd is ready on every poll. */
+static int ready_fd()
+{
+    int fd = eventfd(1, EFD_NONBLOCK);
+
+    if (fd < 0) {
+        printf("eventfd failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+static void c_cb(void *udata)
+{
+    static_cast<struct ctx *>(udata)->count++;
+}
+
+/* Best ns per dispatch over RUNS, all fds are watched by now. */
+template <typename Count>
+static double measure(uint64_t expect_per_run, Count counted)
+{
+    double start, best = 0, ns;
+    uint64_t before;
+    int r, i;
+
+    for (r = 0; r < RUNS; r++) {
+        before = counted();
+        start = now_sec();
+        for (i = 0; i < POLLS; i++)
+            tinyev_poll(0);
+        ns = (now_sec() - start) * 1e9 / expect_per_run;
+        if (counted() - before != expect_per_run) {
+            printf("lost dispatches\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!best || ns < best) best = ns;
+    }
+
+    return best;
+}
+
+static double run_c()
+{
+    std::vector<struct ctx *> ctxs(NFDS);
+    std::vector<void *> evobjs(NFDS);
+    std::vector<int> fds(NFDS);
+    double ns;
+    int i, err;
+
+    /* The way the C tests do it, a context struct per connection. */
+    for (i = 0; i < NFDS; i++) {
+        fds[i] = ready_fd();
+        ctxs[i] = static_cast<struct ctx *>(calloc(1, sizeof(struct ctx)));
+        evobjs[i] = tinyev_add_fd(fds[i], ctxs[i], c_cb, TEV_RECV, &err);
+    }
+
+    ns = measure((uint64_t)NFDS * POLLS, [&] {
+        uint64_t total = 0;
+        for (struct ctx *c : ctxs) total += c->count;
+        return total;
+    });
+
+    for (i = 0; i < NFDS; i++) {
+        tinyev_remove_fd(fds[i], evobjs[i]);
+        free(ctxs[i]);
+    }
+
+    return ns;
+}
+
+static double run_lambda()
+{
+    std::vector<tinyev::Fd> fds;
+    uint64_t count = 0;
+    int i;
+
+    fds.reserve(NFDS);
+    for (i = 0; i < NFDS; i++)
+        fds.emplace_back(ready_fd(), TEV_RECV, [&count] { count++; });
+
+    return measure((uint64_t)NFDS * POLLS, [&] { return count; });
+}
+
+static double run_member()
+{
+    std::vector<tinyev::Fd> fds;
+    Conn conn;
+    int i;
+
+    /* No reserve, the handles move while the vector grows. */
+    for (i = 0; i < NFDS; i++)
+        fds.push_back(tinyev::Fd(ready_fd(), TEV_RECV, tinyev::bind<&Conn::on_ready>(&conn)));
+
+    return measure((uint64_t)NFDS * POLLS, [&] { return conn.count; });
+}
+
+int main(int argc, char *argv[])
+{
+    tinyev::Loop loop;
+    double c, lambda, member;
+
+    if (!loop.ok()) {
+        printf("Failed to init tinyev\n");
+        return -1;
+    }
+
+    c = run_c();
+    lambda = run_lambda();
+    member = run_member();
+
+    printf("%d ready fds, %d polls, ns per dispatch including the poll share\n", NFDS, POLLS);
+    printf("C event_cb + context : %.2f\n", c);
+    printf("C++ lambda           : %.2f (%+.1f%%)\n", lambda, (lambda - c) * 100 / c);
+    printf("C++ member function  : %.2f (%+.1f%%)\n", member, (member - c) * 100 / c);
+
+    return 0;
+}
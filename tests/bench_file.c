@@ -0,0 +1,272 @@
+#define _GNU_SOURCE                 // O_DIRECT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+
+#include "tinyev.h"
+#include "tinyev_file.h"
+
+#define DEFAULT_PATH "bench_file.dat"
+#define DEFAULT_MB 256
+#define CHUNK (64 * 1024)
+#define DEPTH 32                    // Reads in flight
+#define TICK_MSEC 1
+
+static const char *path = DEFAULT_PATH;
+static off_t file_size;
+static int file_fd;
+static off_t next_off;
+static size_t bytes_read;
+static int inflight, errors;
+static bool reading;
+static struct tinyev_hist lateness;
+static uint64_t last_tick_usec;
+
+struct chunk {
+    struct tinyev_buf buf;
+    bool aligned;
+};
+
+static struct chunk chunks[DEPTH];
+
+static uint64_t now_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* What a timer or another connection would see meanwhile. */
+static void tick_cb(void *udata)
+{
+    uint64_t now = now_usec();
+
+    if (last_tick_usec && reading) {
+        uint64_t gap = now - last_tick_usec;
+        tinyev_hist_record(&lateness, gap > TICK_MSEC * 1000 ? gap - TICK_MSEC * 1000 : 0);
+    }
+    last_tick_usec = now;
+}
+
+static int create_file(size_t mb)
+{
+    char *block;
+    size_t i;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+
+    file_size = lseek(fd, 0, SEEK_END);
+    if (file_size >= (off_t)(mb << 20)) {
+        file_size = mb << 20;
+        close(fd);
+        return 0;
+    }
+
+    block = malloc(1 << 20);
+    for (i = 0; i < (1 << 20); i++)
+        block[i] = (char)rand();
+    for (i = 0; i < mb; i++) {
+        if (pwrite(fd, block, 1 << 20, i << 20) != 1 << 20) {
+            free(block);
+            close(fd);
+            return -1;
+        }
+    }
+    fsync(fd);
+    free(block);
+    close(fd);
+    file_size = mb << 20;
+
+    return 0;
+}
+
+/* Out of the page cache, every run reads from the disk. */
+static void drop_cache()
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void issue(struct chunk *c);
+
+static void read_cb(void *udata, ssize_t res)
+{
+    struct chunk *c = udata;
+
+    inflight--;
+    if (res < 0) {
+        errors++;
+    } else {
+        bytes_read += res;
+    }
+
+    if (next_off < file_size) issue(c);
+}
+
+static void issue(struct chunk *c)
+{
+    off_t off = next_off;
+
+    next_off += CHUNK;
+    if (tinyev_file_read(file_fd, c->buf.base, CHUNK, off, read_cb, c)) {
+        errors++;
+        return;
+    }
+    inflight++;
+}
+
+/* pread() right in the loop, an eventfd that stays readable calls it
+    again every iteration. */
+static void blocking_cb(void *udata)
+{
+    ssize_t res = pread(file_fd, chunks[0].buf.base, CHUNK, next_off);
+
+    if (res < 0) errors++;
+    else bytes_read += res;
+    next_off += CHUNK;
+}
+
+static void report(const char *name, double secs)
+{
+    printf("%-22s %7.0f MB/s   tick lateness p50 %5lu us  p99 %6lu us  max %6lu us%s\n",
+           name, bytes_read / secs / (1 << 20),
+           (unsigned long)tinyev_hist_percentile(&lateness, 50),
+           (unsigned long)tinyev_hist_percentile(&lateness, 99),
+           (unsigned long)lateness.max, errors ? "  (errors)" : "");
+}
+
+static void run_start()
+{
+    drop_cache();
+    next_off = 0;
+    bytes_read = 0;
+    errors = 0;
+    tinyev_hist_reset(&lateness);
+    last_tick_usec = 0;
+    reading = true;
+}
+
+static void run_blocking()
+{
+    uint64_t one = 1;
+    double start;
+    void *tev;
+    int efd, err;
+
+    file_fd = open(path, O_RDONLY);
+    efd = eventfd(0, EFD_NONBLOCK);
+    if (write(efd, &one, sizeof(one)) != sizeof(one)) return;
+
+    run_start();
+    start = now_usec();
+    tev = tinyev_add_fd(efd, NULL, blocking_cb, TEV_RECV, &err);
+    while (next_off < file_size)
+        tinyev_poll(100);
+    reading = false;
+    report("blocking pread()", (now_usec() - start) / 1e6);
+
+    tinyev_remove_fd(efd, tev);
+    close(file_fd);
+}
+
+static void run_async(const char *name, enum tinyev_file_backend backend, bool direct)
+{
+    double start;
+    int i;
+
+    if (tinyev_file_init(backend)) {
+        printf("%-22s not available\n", name);
+        return;
+    }
+
+    file_fd = open(path, O_RDONLY | (direct ? O_DIRECT : 0));
+    if (file_fd < 0) {
+        printf("%-22s cannot open, errno %d\n", name, errno);
+        tinyev_file_cleanup();
+        return;
+    }
+
+    for (i = 0; i < DEPTH; i++) {
+        if (direct) {
+            tinyev_file_buf_alloc(CHUNK, &chunks[i].buf);
+            chunks[i].aligned = true;
+        }
+    }
+
+    run_start();
+    start = now_usec();
+    for (i = 0; i < DEPTH && next_off < file_size; i++)
+        issue(&chunks[i]);
+    while (inflight)
+        tinyev_poll(100);
+    reading = false;
+    report(name, (now_usec() - start) / 1e6);
+
+    for (i = 0; i < DEPTH; i++) {
+        if (chunks[i].aligned) {
+            tinyev_file_buf_free(&chunks[i].buf);
+            chunks[i].buf.base = malloc(CHUNK);
+            chunks[i].aligned = false;
+        }
+    }
+    close(file_fd);
+    tinyev_file_cleanup();
+}
+
+int main(int argc, char *argv[])
+{
+    size_t mb = DEFAULT_MB;
+    void *tick;
+    int i;
+
+    if (argc > 1) path = argv[1];
+    if (argc > 2) mb = atoi(argv[2]);
+    if (!mb) {
+        printf("Usage: bench_file [path] [MB]\n");
+        return -1;
+    }
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        return -1;
+    }
+
+    if (create_file(mb)) {
+        printf("Cannot create %s, errno %d\n", path, errno);
+        return -1;
+    }
+
+    for (i = 0; i < DEPTH; i++)
+        chunks[i].buf.base = malloc(CHUNK);
+
+    tick = tinyev_add_periodic(0, TICK_MSEC, NULL, tick_cb);
+
+    printf("%zu MB cold reads of %d KB, %d in flight, %d ms tick\n", mb, CHUNK / 1024, DEPTH, TICK_MSEC);
+    run_blocking();
+    run_async("io_uring", TINYEV_FILE_URING, false);
+    run_async("threads", TINYEV_FILE_THREADS, false);
+    run_async("io_uring, O_DIRECT", TINYEV_FILE_URING, true);
+    run_async("threads, O_DIRECT", TINYEV_FILE_THREADS, true);
+
+    for (i = 0; i < DEPTH; i++)
+        free(chunks[i].buf.base);
+    tinyev_del_timer(tick);
+    tinyev_cleanup();
+    if (argc < 2) unlink(path);
+
+    return 0;
+}
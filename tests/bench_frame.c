@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tinyev.h"
+#include "tinyev_frame.h"
+
+#define STREAM_SIZE (256 * 1024 * 1024)
+#define CHUNK_SIZE (64 * 1024)          // One read worth of data
+#define DEFAULT_LINE 200
+#define RUNS 3
+
+static long frames = 0;
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void frame_cb(void *udata, const char *frame, ssize_t len)
+{
+    frames++;
+}
+
+static double run(const char *stream, size_t size, const struct tinyev_frame_opts *opts)
+{
+    void *fr = tinyev_frame_new(opts, frame_cb, NULL);
+    double start, best = 0, gbs;
+    size_t pos, chunk;
+    int r;
+
+    for (r = 0; r < RUNS; r++) {
+        frames = 0;
+        start = now_sec();
+        for (pos = 0; pos < size; pos += chunk) {
+            chunk = size - pos < CHUNK_SIZE ? size - pos : CHUNK_SIZE;
+            tinyev_frame_feed(fr, stream + pos, chunk);
+        }
+        gbs = size / (now_sec() - start) / 1e9;
+        if (gbs > best) best = gbs;
+    }
+
+    tinyev_frame_free(fr);
+
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *names[] = {"auto", "scalar", "sse2", "avx2"};
+    struct tinyev_frame_opts opts = {.mode = TINYEV_FRAME_DELIM, .delim = '\n'};
+    char *stream = malloc(STREAM_SIZE);
+    int line = DEFAULT_LINE;
+    enum tinyev_simd level, got;
+    size_t pos, len;
+    double gbs;
+
+    if (argc > 1) line = atoi(argv[1]);
+    if (!stream || line < 2) {
+        printf("Usage: bench_frame [avg line length]\n");
+        return -1;
+    }
+
+    /* Printable lines of random length around the average. */
+    srand(1);
+    for (pos = 0; pos < STREAM_SIZE; pos += len) {
+        len = line / 2 + rand() % line;
+        if (len > STREAM_SIZE - pos) len = STREAM_SIZE - pos;
+        memset(stream + pos, 'a' + rand() % 26, len);
+        stream[pos + len - 1] = '\n';
+    }
+
+    for (level = TINYEV_SIMD_SCALAR; level <= TINYEV_SIMD_AVX2; level++) {
+        got = tinyev_frame_simd(level);
+        if (got != level) {
+            printf("%-6s: not supported\n", names[level]);
+            continue;
+        }
+        gbs = run(stream, STREAM_SIZE, &opts);
+        printf("%-6s: %.2f GB/s, %ld frames, avg line %d bytes\n", names[level], gbs, frames, line);
+    }
+
+    free(stream);
+
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#include "tinyev.h"
+
+#define DEFAULT_CONNS 1000000
+#define IDLE_MSEC 1000
+#define TOUCH_SEC 3
+#define REARM_ROUNDS 3
+
+struct conn {
+    int fd;
+    void *tev;
+    void *timer;
+};
+
+static struct conn *conns;
+static int *order;                  // Messages arrive in random order
+static int closed = 0;
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void ev_cb(void *udata)
+{
+}
+
+static void close_cb(void *udata)
+{
+    struct conn *c = udata;
+
+    tinyev_remove_fd(c->fd, c->tev);
+    c->tev = NULL;
+    closed++;
+}
+
+static void timer_cb(void *udata)
+{
+}
+
+static void shuffle(int n)
+{
+    int i, j, tmp;
+
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    for (i = n - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/* What a touch costs with plain timers: delete and add again. Both are
+    O(1), the cost per touch should not grow with n. */
+static void bench_rearm(int n)
+{
+    double start, elapsed;
+    int i, r;
+
+    for (i = 0; i < n; i++)
+        conns[i].timer = tinyev_add_timer(0, IDLE_MSEC, &conns[i], timer_cb);
+
+    start = now_sec();
+    for (r = 0; r < REARM_ROUNDS; r++) {
+        for (i = 0; i < n; i++) {
+            struct conn *c = &conns[order[i] % n];
+
+            tinyev_del_timer(c->timer);
+            c->timer = tinyev_add_timer(0, IDLE_MSEC, c, timer_cb);
+        }
+    }
+    elapsed = now_sec() - start;
+
+    printf("timer re-arm: %d conns, %.1f ns per touch\n",
+           n, elapsed * 1e9 / ((double)n * REARM_ROUNDS));
+
+    for (i = 0; i < n; i++)
+        tinyev_del_timer(conns[i].timer);
+}
+
+int main(int argc, char *argv[])
+{
+    struct rlimit rl;
+    double start, touch_time = 0, poll_time = 0, t;
+    long touches = 0;
+    int n = DEFAULT_CONNS;
+    int i, err;
+
+    if (argc > 1) n = atoi(argv[1]);
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        return -1;
+    }
+
+    conns = calloc(n, sizeof(struct conn));
+    order = malloc(n * sizeof(int));
+    shuffle(n);
+
+    bench_rearm(n / 10 ? n / 10 : 1);
+    bench_rearm(n);
+
+    /* One eventfd per connection, bounded by the fd limit. */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur != RLIM_INFINITY && (rlim_t)n > rl.rlim_cur - 16) {
+            n = rl.rlim_cur - 16;
+            printf("fd limit, using %d conns\n", n);
+            shuffle(n);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        conns[i].fd = eventfd(0, 0);
+        conns[i].tev = tinyev_add_fd(conns[i].fd, &conns[i], ev_cb, TEV_RECV, &err);
+        if (!conns[i].tev) {
+            printf("Failed to add fd, err %d\n", err);
+            return -1;
+        }
+        tinyev_set_idle(conns[i].tev, IDLE_MSEC, close_cb);
+    }
+
+    /* Every connection gets a message every round. */
+    start = now_sec();
+    while (now_sec() - start < TOUCH_SEC) {
+        t = now_sec();
+        for (i = 0; i < n; i++)
+            tinyev_touch(conns[order[i]].tev);
+        touches += n;
+        touch_time += now_sec() - t;
+
+        t = now_sec();
+        tinyev_poll(0);
+        poll_time += now_sec() - t;
+    }
+
+    printf("touch: %d conns, %ld touches, %.1f ns per touch, %.1f%% of time in poll\n",
+           n, touches, touch_time * 1e9 / touches,
+           100 * poll_time / (poll_time + touch_time));
+
+    /* Now let them all time out. */
+    start = now_sec();
+    while (closed < n)
+        tinyev_poll(1000);
+
+    printf("idle: %d of %d closed %.0f ms after the last touch (timeout %d ms)\n",
+           closed, n, (now_sec() - start) * 1000, IDLE_MSEC);
+
+    free(order);
+    free(conns);
+    tinyev_cleanup();
+
+    return 0;
+}
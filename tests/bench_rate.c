@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+
+#include "tinyev.h"
+
+#define DEFAULT_NORMAL 50
+#define READ_SIZE (256 * 1024)
+#define REQ_LEN 64
+#define REQ_MSEC 5                  // Each normal client sends a request this often
+#define RUN_MSEC 2000
+#define HOG_CHUNK (256 * 1024)
+#define FD_BYTES_SEC (20 * 1024 * 1024)
+#define LOOP_BYTES_SEC (40 * 1024 * 1024)
+
+struct conn {
+    int server_fd;
+    void *server_tev;
+    int client_fd;
+    void *client_tev;
+    bool hog;
+    uint64_t sent_usec;             // Request in flight since, 0 if none
+};
+
+static struct conn *conns;
+static int nnormal = DEFAULT_NORMAL;
+static int nconns;
+static volatile bool hog_stop;
+static uint64_t hog_bytes, normal_bytes, replies;
+static uint32_t checksum;
+static struct tinyev_hist rtt;
+
+static uint64_t now_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Parsing stand-in, a few cycles per byte. */
+static void work(const char *buf, size_t len)
+{
+    uint32_t h = checksum;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (uint8_t)buf[i]) * 16777619;
+    checksum = h;
+}
+
+/* Server side, every connection is handled the same. */
+static void server_cb(void *udata, ssize_t nread, struct tinyev_buf *buf)
+{
+    struct conn *c = udata;
+
+    if (nread > 0) {
+        work(buf->base, nread);
+        if (c->hog) {
+            hog_bytes += nread;
+        } else {
+            normal_bytes += nread;
+            tinyev_write(c->server_tev, buf->base, nread);
+        }
+    }
+    tinyev_buf_free(buf);
+}
+
+static void client_cb(void *udata)
+{
+    struct conn *c = udata;
+    char buf[REQ_LEN * 4];
+
+    while (read(c->client_fd, buf, sizeof(buf)) > 0) {
+        if (c->sent_usec) {
+            tinyev_hist_record(&rtt, now_usec() - c->sent_usec);
+            c->sent_usec = 0;
+            replies++;
+        }
+    }
+}
+
+/* Normal clients, one small request each unless one is still out. */
+static void tick_cb(void *udata)
+{
+    char req[REQ_LEN];
+    int i;
+
+    memset(req, 'r', sizeof(req));
+    for (i = 1; i < nconns; i++) {
+        if (conns[i].sent_usec) continue;
+        conns[i].sent_usec = now_usec();
+        if (write(conns[i].client_fd, req, sizeof(req)) != sizeof(req))
+            conns[i].sent_usec = 0;
+    }
+}
+
+/* The aggressive client, writes as fast as the server takes it. */
+static void *hog_main(void *arg)
+{
+    char *chunk = calloc(1, HOG_CHUNK);
+    int fd = *(int *)arg;
+
+    while (!hog_stop) {
+        if (write(fd, chunk, HOG_CHUNK) < 0 && errno != EINTR)
+            break;
+    }
+    free(chunk);
+
+    return NULL;
+}
+
+static void run(const char *name, bool fd_limit, bool loop_limit)
+{
+    struct tinyev_rate fd_rate = {.bytes_sec = FD_BYTES_SEC, .burst_bytes = READ_SIZE};
+    struct tinyev_rate loop_rate = {.bytes_sec = LOOP_BYTES_SEC};
+    struct tinyev_stats before, after;
+    int pair[2], err, i, hog_fd;
+    uint64_t start;
+    pthread_t hog;
+    void *tick;
+
+    for (i = 0; i < nconns; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+            printf("socketpair failed, errno %d\n", errno);
+            exit(1);
+        }
+        conns[i].hog = i == 0;
+        conns[i].sent_usec = 0;
+        conns[i].server_fd = pair[0];
+        conns[i].client_fd = pair[1];
+        conns[i].server_tev = tinyev_add_reader(pair[0], &conns[i], READ_SIZE, NULL, server_cb, &err);
+        /* The hog's end stays blocking for its thread. */
+        if (!conns[i].hog)
+            conns[i].client_tev = tinyev_add_fd(pair[1], &conns[i], client_cb, TEV_RECV, &err);
+        if (fd_limit)
+            tinyev_set_rate(conns[i].server_tev, TINYEV_RATE_READ, &fd_rate);
+    }
+    if (loop_limit)
+        tinyev_set_rate(NULL, TINYEV_RATE_READ, &loop_rate);
+
+    hog_bytes = normal_bytes = replies = 0;
+    hog_stop = false;
+    tinyev_hist_reset(&rtt);
+    tinyev_get_stats(&before);
+    hog_fd = conns[0].client_fd;
+    pthread_create(&hog, NULL, hog_main, &hog_fd);
+    tick = tinyev_add_periodic(0, REQ_MSEC, NULL, tick_cb);
+
+    start = now_usec();
+    while (now_usec() - start < RUN_MSEC * 1000ULL)
+        tinyev_poll(10);
+
+    tinyev_get_stats(&after);
+    printf("%-16s hog %6.1f MB/s (paused %4lu ms), %6.0f replies/s, rtt p50 %5lu us  p99 %6lu us  "
+           "max %6lu us, throttles %lu\n",
+           name, hog_bytes / (RUN_MSEC / 1000.0) / (1 << 20),
+           (unsigned long)tinyev_throttled_msec(conns[0].server_tev),
+           replies / (RUN_MSEC / 1000.0),
+           (unsigned long)tinyev_hist_percentile(&rtt, 50),
+           (unsigned long)tinyev_hist_percentile(&rtt, 99),
+           (unsigned long)rtt.max, (unsigned long)(after.throttles - before.throttles));
+
+    tinyev_del_timer(tick);
+    hog_stop = true;
+    /* Unblocks the hog's write. */
+    shutdown(conns[0].server_fd, SHUT_RDWR);
+    pthread_join(hog, NULL);
+    for (i = 0; i < nconns; i++) {
+        tinyev_remove_fd(conns[i].server_fd, conns[i].server_tev);
+        if (conns[i].hog)
+            close(conns[i].client_fd);
+        else
+            tinyev_remove_fd(conns[i].client_fd, conns[i].client_tev);
+    }
+    tinyev_set_rate(NULL, TINYEV_RATE_READ, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) nnormal = atoi(argv[1]);
+    if (nnormal < 1) {
+        printf("Usage: bench_rate [normal clients]\n");
+        return -1;
+    }
+    nconns = nnormal + 1;
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        return -1;
+    }
+
+    conns = calloc(nconns, sizeof(struct conn));
+    printf("1 aggressive client, %d normal ones with a %d byte request every %d ms\n",
+           nnormal, REQ_LEN, REQ_MSEC);
+    run("no limit", false, false);
+    run("20MB/s per fd", true, false);
+    run("40MB/s loop", false, true);
+    printf("checksum %08x\n", checksum);
+
+    free(conns);
+    tinyev_cleanup();
+
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+
+#include "tinyev.h"
+
+#define DEFAULT_CONNS 200
+#define DEFAULT_HOURS 1
+#define ARRIVAL_MSEC 5000           // Mean time between requests of one conn
+#define HEARTBEAT_SEC 10
+#define DEADLINE_MIN 50             // Per request timer, 50 to 500 millisecs
+#define DEADLINE_SPREAD 450
+#define SIM_START 1000000           // Any start works, away from 0 reads better
+
+struct conn {
+    int fd;
+    void *tev;
+};
+
+static struct conn *conns;
+static int nconns = DEFAULT_CONNS;
+static int slack = 0;
+static const char *trace_path = NULL;
+static uint64_t sim_msec = DEFAULT_HOURS * 3600 * 1000ULL;
+
+static double now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void noop_cb(void *udata)
+{
+}
+
+/* Every request arms its own deadline. */
+static void request_cb(void *udata)
+{
+    tinyev_add_timer_slack(0, DEADLINE_MIN + rand() % DEADLINE_SPREAD, slack, NULL, noop_cb);
+}
+
+/* Lines of "<msec from start> <conn>". */
+static int load_trace(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    unsigned long long at;
+    int conn, n = 0;
+
+    if (!f) return -1;
+
+    while (fscanf(f, "%llu %d", &at, &conn) == 2) {
+        if (conn < 0 || conn >= nconns || at >= sim_msec) continue;
+        if (tinyev_sim_inject(conns[conn].tev, SIM_START + at) == TINYEV_ERR_OK)
+            n++;
+    }
+    fclose(f);
+
+    return n;
+}
+
+/* Poisson arrivals over all conns, generated in time order. */
+static int make_trace()
+{
+    double at = 0, mean = (double)ARRIVAL_MSEC / nconns;
+    int n = 0;
+
+    while (1) {
+        at += -log((rand() + 1.0) / ((double)RAND_MAX + 2.0)) * mean;
+        if (at >= sim_msec) break;
+        tinyev_sim_inject(conns[rand() % nconns].tev, SIM_START + (uint64_t)at);
+        n++;
+    }
+
+    return n;
+}
+
+static void run()
+{
+    static struct tinyev_hist late;
+    struct tinyev_stats st;
+    double start, wall;
+    int i, n, err;
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        exit(EXIT_FAILURE);
+    }
+    tinyev_sim_start(SIM_START);
+    tinyev_hist_reset(&late);
+    tinyev_set_lateness_hist(&late);
+    srand(1);
+
+    conns = calloc(nconns, sizeof(struct conn));
+    for (i = 0; i < nconns; i++) {
+        /* Never ready for real, only the trace makes them readable. */
+        conns[i].fd = eventfd(0, EFD_NONBLOCK);
+        conns[i].tev = tinyev_add_fd(conns[i].fd, &conns[i], request_cb, TEV_RECV, &err);
+        if (!conns[i].tev) {
+            printf("Failed to add fd, err %d\n", err);
+            exit(EXIT_FAILURE);
+        }
+        /* Spread the heartbeats over the first period. */
+        tinyev_sim_start(SIM_START + (uint64_t)i * HEARTBEAT_SEC * 1000 / nconns);
+        tinyev_add_periodic_slack(HEARTBEAT_SEC, 0, slack, NULL, noop_cb);
+    }
+    tinyev_sim_start(SIM_START);
+
+    n = trace_path ? load_trace(trace_path) : make_trace();
+    if (n < 0) {
+        printf("Cannot read trace %s\n", trace_path);
+        exit(EXIT_FAILURE);
+    }
+
+    start = now_sec();
+    while (tinyev_now() < SIM_START + sim_msec)
+        tinyev_poll(-1);
+    wall = now_sec() - start;
+
+    tinyev_get_stats(&st);
+    printf("slack %4d ms: %d events, %.0fx real time, %lu wakeups, %lu timer wakeups, "
+           "%lu fired, %lu reordered\n",
+           slack, n, sim_msec / 1e3 / wall, st.wakeups, st.timer_wakeups, st.timers_fired,
+           st.timers_reordered);
+    printf("               lateness ms: avg %.2f  p50 %lu  p99 %lu  p999 %lu  max %lu\n",
+           st.timers_fired ? (double)st.timer_late_msec / st.timers_fired : 0,
+           tinyev_hist_percentile(&late, 50), tinyev_hist_percentile(&late, 99),
+           tinyev_hist_percentile(&late, 99.9), st.timer_late_max);
+
+    tinyev_cleanup();
+}
+
+int main(int argc, char *argv[])
+{
+    static const int slacks[] = {0, 10, 50, 200};
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "c:h:t:")) != -1) {
+        switch (opt) {
+        case 'c': nconns = atoi(optarg); break;
+        case 'h': sim_msec = atof(optarg) * 3600 * 1000; break;
+        case 't': trace_path = optarg; break;
+        default:
+            printf("Usage: bench_sim [-c conns] [-h simulated hours] [-t trace file]\n");
+            return -1;
+        }
+    }
+
+    if (nconns <= 0 || !sim_msec) {
+        printf("Bad arguments\n");
+        return -1;
+    }
+
+    printf("%d conns, %.1f simulated hours, %s\n", nconns, sim_msec / 3600e3,
+           trace_path ? trace_path : "synthetic trace");
+
+    /* Fresh process per policy, same trace and same random deadlines. */
+    for (i = 0; i < (int)(sizeof(slacks) / sizeof(slacks[0])); i++) {
+        slack = slacks[i];
+        fflush(stdout);
+        if (fork() == 0) {
+            run();
+            exit(EXIT_SUCCESS);
+        }
+        wait(NULL);
+    }
+
+    return 0;
+}
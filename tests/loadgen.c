@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "tests.h"
+#include "tinyev.h"
+#include "tinyev_connect.h"
+#include "tinyev_hist.h"
+
+#define LOOPBACK_ADDR "127.0.0.1"
+#define DEFAULT_CONNS 1000
+#define DEFAULT_SECS 10
+#define DEFAULT_WARMUP 1
+#define DEFAULT_SIZE 64
+#define STREAM_DEPTH 128            // Requests in flight per conn when streaming
+#define RING_SIZE 1024              // Send times kept per conn, a power of 2
+#define READ_SIZE 65536
+#define NSEC 1000000000ULL
+#define CONNECT_MSEC 5000
+
+struct conn {
+    int fd;
+    void *tev;
+    uint64_t ring[RING_SIZE];       // Send times: in flight, then not sent yet
+    uint32_t head;                  // Oldest in flight
+    uint32_t inflight;
+    uint32_t pending;
+    size_t rx;                      // Bytes of the oldest response so far
+    size_t tx_left;                 // Bytes of the newest request still to write
+};
+
+/* Built-in server side. */
+struct echo_conn {
+    int fd;
+    void *tev;
+};
+
+/* Options. */
+static int nconns = DEFAULT_CONNS;
+static int secs = DEFAULT_SECS;
+static int warmup = DEFAULT_WARMUP;
+static size_t req_size = DEFAULT_SIZE;
+static double rate = 0;             // Requests/sec over all conns, 0 for closed loop
+static uint32_t depth = 1;
+
+static struct conn *conns;
+static char *request;
+static struct tinyev_hist hist;
+static uint64_t start_ns, measure_ns, issued = 0, completed = 0, errors = 0, overflows = 0;
+static uint64_t unfinished = 0;
+static int connecting = 0, connect_failed = 0;
+static uint32_t next_conn = 0;
+static bool running = true;
+/* Open loop sends, armed at the next due time with ns resolution. */
+static int send_tfd = -1;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+static void conn_close(struct conn *c)
+{
+    if (!c->tev) return;
+
+    errors++;
+    tinyev_remove_fd(c->fd, c->tev);
+    c->tev = NULL;
+}
+
+static void try_send(struct conn *c)
+{
+    ssize_t bytes;
+
+    if (!c->tev) return;
+
+    /* Closed loop: a new request as soon as there is room. */
+    if (!rate && running) {
+        while (c->inflight + c->pending < depth) {
+            c->ring[(c->head + c->inflight + c->pending) & (RING_SIZE - 1)] = 0;
+            c->pending++;
+        }
+    }
+
+    while (c->tx_left || (c->pending && c->inflight < depth)) {
+        if (!c->tx_left) {
+            /* Closed loop measures from the actual send. */
+            if (!rate)
+                c->ring[(c->head + c->inflight) & (RING_SIZE - 1)] = now_ns();
+            c->inflight++;
+            c->pending--;
+            c->tx_left = req_size;
+        }
+
+        bytes = write(c->fd, request + req_size - c->tx_left, c->tx_left);
+        if (bytes < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                conn_close(c);
+            return;
+        }
+        c->tx_left -= bytes;
+    }
+}
+
+static void read_cb(void *udata)
+{
+    static char buf[READ_SIZE];
+    struct conn *c = udata;
+    ssize_t bytes;
+    uint64_t now;
+
+    bytes = read(c->fd, buf, READ_SIZE);
+    if (bytes <= 0) {
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        conn_close(c);
+        return;
+    }
+
+    now = now_ns();
+    c->rx += bytes;
+    while (c->rx >= req_size && c->inflight) {
+        if (now >= measure_ns && c->ring[c->head & (RING_SIZE - 1)] >= measure_ns) {
+            tinyev_hist_record(&hist, now - c->ring[c->head & (RING_SIZE - 1)]);
+            completed++;
+        }
+        c->head++;
+        c->inflight--;
+        c->rx -= req_size;
+    }
+
+    try_send(c);
+}
+
+static uint64_t due_ns(uint64_t n)
+{
+    return start_ns + (uint64_t)(n * NSEC / rate);
+}
+
+static void arm_send(uint64_t at)
+{
+    struct itimerspec its = {0};
+
+    its.it_value.tv_sec = at / NSEC;
+    its.it_value.tv_nsec = at % NSEC;
+    timerfd_settime(send_tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Open loop: hand out every request that is due by now, round robin, then
+    sleep until the next one is due. */
+static void send_cb(void *udata)
+{
+    struct conn *c;
+    uint64_t expirations, now;
+
+    if (read(send_tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        return;
+    if (!running) return;
+
+    now = now_ns();
+    for (; due_ns(issued) <= now; issued++) {
+        c = &conns[next_conn++ % nconns];
+        if (!c->tev) continue;
+        /* Not sending it would hide the stall, the run is not valid. */
+        if (c->inflight + c->pending == RING_SIZE) {
+            overflows++;
+            continue;
+        }
+        /* Keep the time it was due, that is the fix for coordinated
+            omission: waiting to be sent is latency too. */
+        c->ring[(c->head + c->inflight + c->pending) & (RING_SIZE - 1)] = due_ns(issued);
+        c->pending++;
+        try_send(c);
+    }
+
+    arm_send(due_ns(issued));
+}
+
+/* Requests still waiting at the end took at least this long, leaving them
+    out would make the tail look better than it was. */
+static void record_unfinished(uint64_t end)
+{
+    struct conn *c;
+    uint64_t sent;
+    uint32_t j;
+    int i;
+
+    for (i = 0; i < nconns; i++) {
+        c = &conns[i];
+        for (j = 0; j < c->inflight + c->pending; j++) {
+            sent = c->ring[(c->head + j) & (RING_SIZE - 1)];
+            if (sent < measure_ns || sent > end) continue;
+            tinyev_hist_record(&hist, end - sent);
+            unfinished++;
+        }
+    }
+}
+
+/* End of the run, and writes that hit a full socket buffer. */
+static void tick_cb(void *udata)
+{
+    uint64_t now = now_ns();
+    int i;
+
+    if (now - start_ns >= (uint64_t)(warmup + secs) * NSEC) {
+        running = false;
+        return;
+    }
+
+    for (i = 0; i < nconns; i++)
+        if (conns[i].tx_left || (conns[i].pending && conns[i].inflight < depth))
+            try_send(&conns[i]);
+}
+
+static void echo_cb(void *udata, ssize_t nread, struct tinyev_buf *buf)
+{
+    struct echo_conn *c = udata;
+
+    if (nread > 0) {
+        if (write(c->fd, buf->base, nread) != nread)
+            printf("server: short write\n");
+    } else if (nread < 0) {
+        tinyev_remove_fd(c->fd, c->tev);
+        free(c);
+    }
+
+    tinyev_buf_free(buf);
+}
+
+static void accept_cb(void *udata)
+{
+    int lfd = (int)(long)udata;
+    struct echo_conn *c;
+    int fd, one = 1, err;
+
+    while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c = malloc(sizeof(struct echo_conn));
+        c->fd = fd;
+        c->tev = tinyev_add_reader(fd, c, 0, NULL, echo_cb, &err);
+        if (!c->tev) {
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+/* Built-in echo server in a child process, for runs without test_server. */
+static pid_t start_server(struct sockaddr_in *addr)
+{
+    int lfd, one = 1, err;
+    pid_t pid;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(lfd, (struct sockaddr *)addr, sizeof(*addr)) < 0 || listen(lfd, 4096) < 0) {
+        printf("server: cannot listen, errno %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        if (tinyev_init() || !tinyev_add_fd(lfd, (void *)(long)lfd, accept_cb, TEV_RECV, &err))
+            exit(EXIT_FAILURE);
+        while (1)
+            tinyev_poll(1000);
+    }
+
+    close(lfd);
+
+    return pid;
+}
+
+static void connected_cb(void *udata, int fd, int err)
+{
+    struct conn *c = udata;
+    int one = 1;
+
+    connecting--;
+    if (fd < 0) {
+        if (!connect_failed++)
+            printf("Connection %ld failed, errno %d\n", (long)(c - conns), -err);
+        return;
+    }
+
+    c->fd = fd;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->tev = tinyev_add_fd(fd, c, read_cb, TEV_RECV | TEV_CLOSE | TEV_ERROR, &err);
+    if (!c->tev) {
+        printf("Failed to add fd, err %d\n", err);
+        close(fd);
+        connect_failed++;
+    }
+}
+
+static void usage()
+{
+    printf("Usage: loadgen [-a addr] [-p port] [-c conns] [-d secs] [-w warmup secs]\n"
+           "               [-s request size] [-r total req/s] [-m rr|stream] [-k depth] [-S]\n"
+           "  -r 0 (default) is closed loop, otherwise open loop at that rate\n"
+           "  -S starts a built-in echo server on addr:port\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr = {0};
+    struct addrinfo ai = {0};
+    struct rlimit rl;
+    const char *ip = LOOPBACK_ADDR;
+    const char *mode = "rr";
+    uint16_t port = DEFAULT_PORT;
+    pid_t server = 0;
+    uint64_t end_ns;
+    double elapsed;
+    int opt, i, err;
+
+    while ((opt = getopt(argc, argv, "a:p:c:d:w:s:r:m:k:S")) != -1) {
+        switch (opt) {
+        case 'a': ip = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': nconns = atoi(optarg); break;
+        case 'd': secs = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 's': req_size = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'm':
+            mode = optarg;
+            if (strcmp(mode, "stream") == 0) depth = STREAM_DEPTH;
+            else if (strcmp(mode, "rr") != 0) usage();
+            break;
+        case 'k': depth = atoi(optarg); break;
+        case 'S': server = 1; break;
+        default: usage();
+        }
+    }
+
+    if (nconns <= 0 || secs <= 0 || req_size < 1 || depth < 1 || depth > RING_SIZE)
+        usage();
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0) {
+        printf("Bad address %s\n", ip);
+        return -1;
+    }
+
+    if (server)
+        server = start_server(&addr);
+
+    /* Echo servers answer line by line. */
+    request = malloc(req_size);
+    memset(request, 'x', req_size);
+    request[req_size - 1] = '\n';
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        return -1;
+    }
+
+    /* All connects at once, without blocking on each. */
+    ai.ai_family = AF_INET;
+    ai.ai_socktype = SOCK_STREAM;
+    ai.ai_addr = (struct sockaddr *)&addr;
+    ai.ai_addrlen = sizeof(addr);
+    conns = calloc(nconns, sizeof(struct conn));
+    for (i = 0; i < nconns; i++) {
+        conns[i].fd = -1;
+        if (!tinyev_connect(&ai, CONNECT_MSEC, 0, connected_cb, &conns[i], &err)) {
+            printf("Connection %d failed, err %d\n", i, err);
+            return -1;
+        }
+        connecting++;
+    }
+    while (connecting)
+        tinyev_poll(100);
+    if (connect_failed) {
+        printf("%d of %d connections failed\n", connect_failed, nconns);
+        return -1;
+    }
+
+    tinyev_hist_reset(&hist);
+    start_ns = now_ns();
+    measure_ns = start_ns + (uint64_t)warmup * NSEC;
+    tinyev_add_periodic(0, 1, NULL, tick_cb);
+    if (rate) {
+        send_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (send_tfd < 0 || !tinyev_add_fd(send_tfd, NULL, send_cb, TEV_RECV, &err)) {
+            printf("Failed to set up the send timer\n");
+            return -1;
+        }
+        arm_send(start_ns);
+    }
+    for (i = 0; i < nconns; i++)
+        try_send(&conns[i]);
+
+    while (running)
+        tinyev_poll(100);
+
+    end_ns = now_ns();
+    record_unfinished(end_ns);
+    elapsed = (end_ns - measure_ns) / 1e9;
+
+    printf("%d connections, %s depth %u, %zu byte requests, %s",
+           nconns, mode, depth, req_size, rate ? "open loop" : "closed loop");
+    if (rate)
+        printf(" at %.0f req/s", rate);
+    printf("\n%lu requests in %.2f s: %.0f req/s, %.2f MB/s each way, %lu errors",
+           completed, elapsed, completed / elapsed, completed * req_size / elapsed / 1e6, errors);
+    if (unfinished)
+        printf(", %lu unfinished at the end (in the latencies up to then)", unfinished);
+    if (overflows)
+        printf(", %lu requests could not be sent (server too slow), RUN NOT VALID", overflows);
+    printf("\nlatency usec: p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           tinyev_hist_percentile(&hist, 50) / 1e3, tinyev_hist_percentile(&hist, 99) / 1e3,
+           tinyev_hist_percentile(&hist, 99.9) / 1e3, hist.max / 1e3);
+
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+
+    free(conns);
+    free(request);
+    tinyev_cleanup();
+
+    return overflows ? EXIT_FAILURE : 0;
+}
@@ -11,9 +11,11 @@
 
 #include "tests.h"
 #include "tinyev.h"
+#include "tinyev_connect.h"
 
 #define BUF_SIZE 2048
 #define LOOPBACK_ADDR "127.0.0.1"
+#define CONNECT_TIMEOUT_MSEC 5000
 
 struct event_data {
     int fd;
@@ -21,7 +23,7 @@ struct event_data {
 };
 
 static char input[BUF_SIZE] = {0};
-int fd;
+int fd = -1;
 
 void ev_cb(void *udata)
 {
@@ -50,76 +52,50 @@ void ev_cb(void *udata)
     }
 }
 
-int main(int argc, char *argv[])
+static void connected_cb(void *udata, int cfd, int err)
 {
-    struct event_data data_fd, data_stdio;
-    struct sockaddr_in saddr;
-    struct hostent *host = NULL;
-    struct in6_addr ip;
-    u_int16_t port = 0;
-    int inet = AF_INET;
+    struct event_data *data = udata;
     int rc;
 
-    if (argc < 2) {
-        port = DEFAULT_PORT;
-        host = gethostbyname(LOOPBACK_ADDR);
-        printf("Using default port %d and address %s\n", port, LOOPBACK_ADDR);
-        goto conn;
-    }
-
-    if (strchr(argv[1], '.') || strchr(argv[1], ':')) {
-        /* IP address was provided. */
-        host = gethostbyname(argv[1]);
-        if (!host) {
-            printf("Illegal IP address, abort\n");
-            exit(EXIT_FAILURE);
-        }
-
-        inet = strchr(argv[1], '.') ? AF_INET : AF_INET6;
-        if (inet_pton(inet, argv[1], &ip) <= 0) {
-            printf("inet_pton failed\n");
-            return -1;
-        }
-        port = DEFAULT_PORT;
-    } else {
-        /* Port was provided. */
-        port = atoi(argv[1]);
-        /* Use default address. */
-        host = gethostbyname(LOOPBACK_ADDR);
-    }
-
-    if (argc == 3) {
-        /* IP address and port were provided. */
-        host = gethostbyname(argv[1]);
-        if (!host) {
-            printf("Illegal IP address, abort\n");
-            exit(EXIT_FAILURE);
-        }
-        port = atoi(argv[2]);
-    } else if (argc > 3) {
-        printf("Wrong usage! Try 'test_client 192.168.1.123 5432'\n");
+    if (cfd < 0) {
+        printf("connect failed, errno %d\n", -err);
         exit(EXIT_FAILURE);
     }
+    printf("The Socket is now connected, fd %d\n", cfd);
 
-conn:
-    fd = socket(inet, SOCK_STREAM, IPPROTO_TCP);
-    if (fd == -1) {
-        perror("socket failed \n");
+    fd = cfd;
+    data->fd = fd;
+    data->tev = tinyev_add_fd(fd, data, ev_cb, TEV_RECV | TEV_CLOSE | TEV_ERROR, &rc);
+    if (!data->tev) {
+        printf("Failed to add fd, err %d\n", rc);
         exit(EXIT_FAILURE);
     }
-    printf("Created a socket with fd: %d\n", fd);
+}
 
-    saddr.sin_family = inet;
-    saddr.sin_port = htons(port);     
-    saddr.sin_addr = *((struct in_addr *)host->h_addr);
+int main(int argc, char *argv[])
+{
+    struct event_data data_fd, data_stdio;
+    const char *host = LOOPBACK_ADDR;
+    char port[8];
+    u_int16_t port_num = DEFAULT_PORT;
+    int rc;
 
-    rc = connect(fd, (struct sockaddr *)&saddr, sizeof(struct sockaddr_in));
-    if (rc == -1) {
-        perror("connect failed");
-        close(fd);
+    if (argc < 2) {
+        printf("Using default port %d and address %s\n", port_num, LOOPBACK_ADDR);
+    } else if (argc == 2) {
+        if (strchr(argv[1], '.') || strchr(argv[1], ':'))
+            host = argv[1];             // IP address or name was provided
+        else
+            port_num = atoi(argv[1]);   // Port was provided
+    } else if (argc == 3) {
+        /* IP address and port were provided. */
+        host = argv[1];
+        port_num = atoi(argv[2]);
+    } else {
+        printf("Wrong usage! Try 'test_client 192.168.1.123 5432'\n");
         exit(EXIT_FAILURE);
     }
-    printf("The Socket is now connected\n");
+    snprintf(port, sizeof(port), "%u", port_num);
 
     rc = tinyev_init();
     if (rc) {
@@ -127,10 +103,9 @@ conn:
         exit(EXIT_FAILURE);
     }
 
-    data_fd.fd = fd;
-    data_fd.tev = tinyev_add_fd(fd, &data_fd, ev_cb, TEV_RECV | TEV_CLOSE | TEV_ERROR, &rc);
-    if (!data_fd.tev) {
-        printf("Failed to add fd, err %d\n", rc);
+    /* Resolved and connected without freezing the loop. */
+    if (!tinyev_connect_host(host, port, CONNECT_TIMEOUT_MSEC, connected_cb, &data_fd, &rc)) {
+        printf("Failed to start connecting, err %d\n", rc);
         exit(EXIT_FAILURE);
     }
 
@@ -145,5 +120,6 @@ conn:
         tinyev_poll(200);   // wake up 5 times a second
     }
 
+    tinyev_connect_cleanup();
     tinyev_cleanup();
-}
\ No newline at end of file
+}
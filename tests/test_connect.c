@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "tinyev.h"
+#include "tinyev_connect.h"
+
+#define SLOW_PORT 23500             // Full backlog, the SYN is dropped
+#define FAST_PORT 23501
+#define STAGGER_MSEC 1
+#define RETRY_WAIT_SEC 2            // First SYN retransmit comes after 1s
+#define TIMEOUT_MSEC 10000
+
+struct pair_cb {
+    int fd;
+    void *tev;
+    struct pair_cb *other;
+};
+
+static int calls = 0, signals = 0;
+static struct pair_cb *ran = NULL;
+static int winner_fd = -1;
+
+/* Each removes the other, only the first of the batch may run. */
+static void pair_cb(void *udata)
+{
+    struct pair_cb *p = udata;
+    char c;
+
+    calls++;
+    ran = p;
+    if (read(p->fd, &c, 1) < 0) return;
+    tinyev_remove_fd(p->other->fd, p->other->tev);
+}
+
+static int test_remove_in_batch()
+{
+    struct pair_cb p[2];
+    int a[2], b[2], err;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, a) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, b) < 0)
+        return -1;
+
+    p[0].fd = a[0];
+    p[0].other = &p[1];
+    p[1].fd = b[0];
+    p[1].other = &p[0];
+    p[0].tev = tinyev_add_fd(a[0], &p[0], pair_cb, TEV_RECV, &err);
+    p[1].tev = tinyev_add_fd(b[0], &p[1], pair_cb, TEV_RECV, &err);
+
+    /* Both readable before the loop looks. */
+    if (write(a[1], "x", 1) != 1 || write(b[1], "x", 1) != 1)
+        return -1;
+    tinyev_poll(100);
+    tinyev_poll(0);
+
+    printf("remove in batch: %d callback(s)\n", calls);
+    close(a[1]);
+    close(b[1]);
+    if (calls == 1)
+        tinyev_remove_fd(ran->fd, ran->tev);
+
+    return calls == 1 ? 0 : -1;
+}
+
+static int listen_on(int port, int backlog)
+{
+    struct sockaddr_in sin;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(fd, backlog) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void connected_cb(void *udata, int fd, int err)
+{
+    calls++;
+    winner_fd = fd;
+}
+
+/* The slow address connects while the fast one is still to be dispatched,
+    both attempts are done in the same batch. */
+static int test_attempts_in_batch()
+{
+    struct sockaddr_in sin[2];
+    struct addrinfo ai[2];
+    struct pollfd pfd;
+    int slow_fd, fast_fd, filler, err;
+
+    slow_fd = listen_on(SLOW_PORT, 0);
+    fast_fd = listen_on(FAST_PORT, 16);
+    if (slow_fd < 0 || fast_fd < 0) {
+        printf("Cannot listen, errno %d\n", errno);
+        return -1;
+    }
+
+    /* Takes the only place in the slow accept queue. */
+    filler = socket(AF_INET, SOCK_STREAM, 0);
+    memset(sin, 0, sizeof(sin));
+    sin[0].sin_family = sin[1].sin_family = AF_INET;
+    sin[0].sin_addr.s_addr = sin[1].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin[0].sin_port = htons(SLOW_PORT);
+    sin[1].sin_port = htons(FAST_PORT);
+    if (connect(filler, (struct sockaddr *)&sin[0], sizeof(sin[0])) < 0) {
+        printf("Cannot connect, errno %d\n", errno);
+        return -1;
+    }
+
+    memset(ai, 0, sizeof(ai));
+    ai[0].ai_family = ai[1].ai_family = AF_INET;
+    ai[0].ai_socktype = ai[1].ai_socktype = SOCK_STREAM;
+    ai[0].ai_addrlen = ai[1].ai_addrlen = sizeof(struct sockaddr_in);
+    ai[0].ai_addr = (struct sockaddr *)&sin[0];
+    ai[1].ai_addr = (struct sockaddr *)&sin[1];
+    ai[0].ai_next = &ai[1];
+
+    calls = 0;
+    if (!tinyev_connect(ai, TIMEOUT_MSEC, STAGGER_MSEC, connected_cb, NULL, &err))
+        return -1;
+
+    /* Until the stagger timer started the fast attempt, which is done right
+        away but not dispatched yet. */
+    pfd.fd = fast_fd;
+    pfd.events = POLLIN;
+    while (!poll(&pfd, 1, 0))
+        tinyev_poll(10);
+
+    /* Room for the slow one's SYN retransmit, then let both be seen. */
+    close(accept(slow_fd, NULL, NULL));
+    sleep(RETRY_WAIT_SEC);
+    tinyev_poll(0);
+    tinyev_poll(0);
+
+    printf("attempts in batch: %d callback(s), fd %d\n", calls, winner_fd);
+    if (winner_fd >= 0)
+        close(winner_fd);
+    close(filler);
+    close(slow_fd);
+    close(fast_fd);
+
+    return calls == 1 && winner_fd >= 0 ? 0 : -1;
+}
+
+/* Nothing of the user's is left once connected by name and closed. */
+static int test_waiting_after_resolve()
+{
+    char port[8];
+    int lfd, err;
+
+    lfd = listen_on(FAST_PORT, 16);
+    if (lfd < 0) {
+        printf("Cannot listen, errno %d\n", errno);
+        return -1;
+    }
+
+    calls = 0;
+    winner_fd = -1;
+    snprintf(port, sizeof(port), "%d", FAST_PORT);
+    if (!tinyev_connect_host("127.0.0.1", port, TIMEOUT_MSEC, connected_cb, NULL, &err))
+        return -1;
+    while (!calls)
+        tinyev_poll(100);
+    if (winner_fd >= 0)
+        close(winner_fd);
+    close(lfd);
+
+    printf("after resolve: fd %d, %s\n", winner_fd, tinyev_waiting() ? "still waiting" : "not waiting");
+
+    return winner_fd >= 0 && !tinyev_waiting() ? 0 : -1;
+}
+
+static void signal_cb(void *udata)
+{
+    signals++;
+}
+
+/* The resolver threads are running, a signal blocked afterwards on the
+    loop thread only must still reach the loop. */
+static int test_signal_after_resolve()
+{
+    int i;
+
+    if (tinyev_add_signal(SIGHUP, signal_cb, NULL))
+        return -1;
+    kill(getpid(), SIGHUP);
+    /* Time for a resolver thread to take it, if it could. */
+    usleep(10000);
+    for (i = 0; i < 10 && !signals; i++)
+        tinyev_poll(100);
+    tinyev_del_signal(SIGHUP);
+
+    printf("signal after resolve: %d signal(s)\n", signals);
+
+    return signals == 1 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int rc = 0;
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        return -1;
+    }
+
+    if (test_remove_in_batch())
+        rc = -1;
+    if (test_attempts_in_batch())
+        rc = -1;
+    if (test_waiting_after_resolve())
+        rc = -1;
+    if (test_signal_after_resolve())
+        rc = -1;
+
+    tinyev_connect_cleanup();
+    tinyev_cleanup();
+    printf("%s\n", rc ? "FAILED" : "PASSED");
+
+    return rc;
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "tinyev.h"
+#include "tinyev_file.h"
+
+#define TEST_PATH "test_file.dat"
+#define CHUNK 4096
+#define NCHUNKS 8
+
+/* One operation, what it got back and how often. */
+struct op {
+    ssize_t res;
+    int calls;
+};
+
+static char wbuf[NCHUNKS][CHUNK];
+static char rbuf[NCHUNKS][CHUNK];
+static char scratch[CHUNK];
+static struct op writes[NCHUNKS], reads[NCHUNKS], sync_op, eof_op, bad_op;
+static int pending, signals;
+
+static void op_cb(void *udata, ssize_t res)
+{
+    struct op *op = udata;
+
+    op->res = res;
+    op->calls++;
+    pending--;
+}
+
+static void signal_cb(void *udata)
+{
+    signals++;
+}
+
+static void wait_all()
+{
+    int i;
+
+    for (i = 0; i < 100 && pending; i++)
+        tinyev_poll(100);
+}
+
+/* Writes, an fsync and reads back on one backend. */
+static int run(const char *name, enum tinyev_file_backend backend)
+{
+    int fd, i, rc = 0;
+
+    if (tinyev_file_init(backend)) {
+        printf("%-8s not available\n", name);
+        return backend == TINYEV_FILE_THREADS ? -1 : 0;
+    }
+    /* Blocked after the backend's threads started. */
+    if (tinyev_add_signal(SIGUSR1, signal_cb, NULL)) {
+        printf("Failed to add signal\n");
+        tinyev_file_cleanup();
+        return -1;
+    }
+
+    fd = open(TEST_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Cannot open %s, errno %d\n", TEST_PATH, errno);
+        tinyev_del_signal(SIGUSR1);
+        tinyev_file_cleanup();
+        return -1;
+    }
+    memset(writes, 0, sizeof(writes));
+    memset(reads, 0, sizeof(reads));
+    memset(&sync_op, 0, sizeof(sync_op));
+    memset(&eof_op, 0, sizeof(eof_op));
+    memset(&bad_op, 0, sizeof(bad_op));
+    memset(rbuf, 0, sizeof(rbuf));
+    signals = 0;
+
+    /* Last chunk first, the offsets have to be honoured. */
+    for (i = NCHUNKS - 1; i >= 0; i--) {
+        if (!tinyev_file_write(fd, wbuf[i], CHUNK, (off_t)i * CHUNK, op_cb, &writes[i]))
+            pending++;
+    }
+    /* Workers are running, a signal must still reach the loop. Time for
+        one of them to take it, if they could. */
+    kill(getpid(), SIGUSR1);
+    usleep(10000);
+    wait_all();
+    if (!tinyev_file_fsync(fd, false, op_cb, &sync_op))
+        pending++;
+    wait_all();
+
+    for (i = 0; i < NCHUNKS; i++) {
+        if (!tinyev_file_read(fd, rbuf[i], CHUNK, (off_t)i * CHUNK, op_cb, &reads[i]))
+            pending++;
+    }
+    if (!tinyev_file_read(fd, scratch, CHUNK, (off_t)NCHUNKS * CHUNK, op_cb, &eof_op))
+        pending++;
+    if (!tinyev_file_read(-1, scratch, CHUNK, 0, op_cb, &bad_op))
+        pending++;
+    wait_all();
+    if (!signals)
+        tinyev_poll(100);
+
+    for (i = 0; i < NCHUNKS; i++) {
+        if (writes[i].calls != 1 || writes[i].res != CHUNK || reads[i].calls != 1 ||
+            reads[i].res != CHUNK || memcmp(rbuf[i], wbuf[i], CHUNK))
+            rc = -1;
+    }
+    if (sync_op.calls != 1 || sync_op.res != 0 || eof_op.calls != 1 || eof_op.res != 0 ||
+        bad_op.calls != 1 || bad_op.res != -EBADF || signals != 1 || pending)
+        rc = -1;
+
+    printf("%-8s %d writes, fsync %zd, %d reads, EOF read %zd, bad fd read %zd, %d signal(s): %s\n",
+           name, NCHUNKS, sync_op.res, NCHUNKS, eof_op.res, bad_op.res, signals, rc ? "bad" : "ok");
+
+    close(fd);
+    unlink(TEST_PATH);
+    tinyev_del_signal(SIGUSR1);
+    tinyev_file_cleanup();
+
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, j, rc = 0;
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        return -1;
+    }
+    for (i = 0; i < NCHUNKS; i++) {
+        for (j = 0; j < CHUNK; j++)
+            wbuf[i][j] = (char)(i * 31 + j);
+    }
+
+    if (run("io_uring", TINYEV_FILE_URING))
+        rc = -1;
+    if (run("threads", TINYEV_FILE_THREADS))
+        rc = -1;
+
+    tinyev_cleanup();
+    printf("%s\n", rc ? "FAILED" : "PASSED");
+
+    return rc;
+}
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tinyev.h"
+#include "tinyev_handoff.h"
+
+#define HANDOFF_PATH "/tmp/tinyev_handoff.sock"
+#define PERSIST_TAG 42
+#define HANDOFF_AT_MSEC 500
+#define CHURN_MSEC 1500
+#define MAX_FDS 16
+#define MSG "ping"
+
+struct conn {
+    int fd;
+    void *tev;
+    bool persist;
+};
+
+static int listen_fd;
+static void *listen_tev;
+static struct conn *persist;
+static bool stop = false;
+
+static double now_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void echo_cb(void *udata)
+{
+    struct conn *c = udata;
+    char buf[64];
+    int bytes;
+
+    bytes = read(c->fd, buf, sizeof(buf));
+    if (bytes <= 0) {
+        if (bytes < 0 && errno == EAGAIN) return;
+        if (c->persist) stop = true;
+        tinyev_remove_fd(c->fd, c->tev);
+        free(c);
+        return;
+    }
+
+    if (write(c->fd, buf, bytes) != bytes)
+        printf("Failed to echo\n");
+}
+
+static struct conn *add_conn(int fd, bool persist)
+{
+    struct conn *c = calloc(1, sizeof(struct conn));
+    int err;
+
+    c->fd = fd;
+    c->persist = persist;
+    c->tev = tinyev_add_fd(fd, c, echo_cb, TEV_RECV | TEV_CLOSE | TEV_ERROR, &err);
+    if (!c->tev) {
+        printf("Failed to add fd, err %d\n", err);
+        exit(EXIT_FAILURE);
+    }
+
+    return c;
+}
+
+static void accept_cb(void *udata)
+{
+    int fd;
+
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        /* The client opens its long lived connection first. */
+        if (!persist)
+            persist = add_conn(fd, true);
+        else
+            add_conn(fd, false);
+    }
+}
+
+/* Old process: pass the listener and the warm connection on, then drain. */
+static void handoff_cb(void *udata)
+{
+    struct tinyev_handoff_fd fds[2] = {
+        {.fd = listen_fd, .tag = 0},
+        {.fd = persist->fd, .tag = PERSIST_TAG},
+    };
+    double start = now_msec();
+
+    if (tinyev_handoff_send(HANDOFF_PATH, fds, 2)) {
+        printf("old: handoff failed, keep serving\n");
+        return;
+    }
+
+    tinyev_remove_fd(listen_fd, listen_tev);
+    tinyev_remove_fd(persist->fd, persist->tev);
+    free(persist);
+    printf("old: handed off in %.2f ms, draining\n", now_msec() - start);
+}
+
+static void old_server()
+{
+    int err;
+
+    if (tinyev_init()) exit(EXIT_FAILURE);
+
+    listen_tev = tinyev_add_fd(listen_fd, NULL, accept_cb, TEV_RECV, &err);
+    tinyev_add_timer(0, HANDOFF_AT_MSEC, NULL, handoff_cb);
+
+    while (tinyev_waiting())
+        tinyev_poll(200);
+
+    printf("old: drained, exit\n");
+    tinyev_cleanup();
+}
+
+static void new_server()
+{
+    struct tinyev_handoff_fd fds[MAX_FDS];
+    double start;
+    int i, n, err;
+
+    /* A fresh process does not have the listener. */
+    close(listen_fd);
+    listen_fd = -1;
+
+    n = tinyev_handoff_recv(HANDOFF_PATH, fds, MAX_FDS, 5000);
+    start = now_msec();
+    if (n <= 0 || tinyev_init()) {
+        printf("new: no fds received\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (fds[i].flags & TINYEV_HANDOFF_LISTENER) {
+            listen_fd = fds[i].fd;
+            listen_tev = tinyev_add_fd(listen_fd, NULL, accept_cb, TEV_RECV, &err);
+        } else if (fds[i].tag == PERSIST_TAG) {
+            persist = add_conn(fds[i].fd, true);
+        }
+    }
+    printf("new: got %d fds, serving after %.2f ms\n", n, now_msec() - start);
+
+    while (!stop)
+        tinyev_poll(200);
+
+    tinyev_cleanup();
+}
+
+static int ping(int fd)
+{
+    char buf[sizeof(MSG)];
+
+    if (write(fd, MSG, sizeof(MSG)) != sizeof(MSG)) return -1;
+    if (read(fd, buf, sizeof(buf)) != sizeof(MSG)) return -1;
+
+    return 0;
+}
+
+static int client(struct sockaddr_in *addr)
+{
+    double start, t, worst = 0;
+    int fd, pfd, ok = 0, lost = 0, persist_lost = 0;
+
+    close(listen_fd);
+    usleep(100000);
+
+    pfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(pfd, (struct sockaddr *)addr, sizeof(*addr)) < 0 || ping(pfd) < 0) {
+        printf("client: no persistent connection\n");
+        return EXIT_FAILURE;
+    }
+
+    /* New connection after new connection, across the handoff. */
+    start = now_msec();
+    while (now_msec() - start < CHURN_MSEC) {
+        t = now_msec();
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 || ping(fd) < 0)
+            lost++;
+        else
+            ok++;
+        close(fd);
+
+        t = now_msec() - t;
+        if (t > worst) worst = t;
+
+        if (ok % 100 == 0 && ping(pfd) < 0)
+            persist_lost++;
+    }
+
+    if (ping(pfd) < 0)
+        persist_lost++;
+    close(pfd);
+
+    printf("client: %d connections ok, %d lost, longest connect+echo %.2f ms, persistent %s\n",
+           ok, lost, worst, persist_lost ? "BROKEN" : "ok");
+
+    return (lost || persist_lost) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr = {0};
+    socklen_t len = sizeof(addr);
+    pid_t pid_client, pid_new;
+    int status, rc = 0;
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 128) < 0 || getsockname(listen_fd, (struct sockaddr *)&addr, &len) < 0) {
+        printf("Failed to listen\n");
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_new = fork();
+    if (pid_new == 0) {
+        new_server();
+        exit(EXIT_SUCCESS);
+    }
+
+    pid_client = fork();
+    if (pid_client == 0)
+        exit(client(&addr));
+
+    old_server();
+
+    waitpid(pid_client, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        rc = -1;
+    waitpid(pid_new, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        rc = -1;
+
+    printf("%s\n", rc ? "FAILED" : "PASSED");
+
+    return rc;
+}
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "tinyev.h"
+
+#define RUN_MSEC 500                // Well within the refill of one op
+#define POLL_MSEC 5
+#define MAX_WAKEUPS (3 * RUN_MSEC / POLL_MSEC)
+#define ALARM_USEC 500              // Signals handled outside of tinyev
+#define TIMER_MSEC 20
+#define MAX_LATE_MSEC 100
+#define TURN_READERS 3
+#define TURN_MSEC 300
+#define TURN_BYTES_SEC 2000         // A few bytes per millisec for everyone
+
+static int reads = 0, signals = 0, alarms = 0, fired = 0;
+
+static uint64_t now_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void read_cb(void *udata, ssize_t nread, struct tinyev_buf *buf)
+{
+    if (nread > 0)
+        reads++;
+    tinyev_buf_free(buf);
+}
+
+static void turn_cb(void *udata, ssize_t nread, struct tinyev_buf *buf)
+{
+    if (nread > 0)
+        (*(int *)udata)++;
+    tinyev_buf_free(buf);
+}
+
+static void signal_cb(void *udata)
+{
+    signals++;
+    if (udata)
+        (*(int *)udata)++;
+}
+
+static void alarm_handler(int signo)
+{
+    alarms++;
+}
+
+static void timer_cb(void *udata)
+{
+    fired++;
+}
+
+/* Each signal comes once, with its own user data, in any order. */
+static int test_signal_delivery()
+{
+    int usr1 = 0, usr2 = 0, i;
+
+    signals = 0;
+    if (tinyev_add_signal(SIGUSR1, signal_cb, &usr1) || tinyev_add_signal(SIGUSR2, signal_cb, &usr2))
+        return -1;
+    kill(getpid(), SIGUSR2);
+    kill(getpid(), SIGUSR1);
+    for (i = 0; i < 10 && signals < 2; i++)
+        tinyev_poll(100);
+    tinyev_poll(0);
+    tinyev_del_signal(SIGUSR1);
+    tinyev_del_signal(SIGUSR2);
+
+    printf("signal delivery: SIGUSR1 %d, SIGUSR2 %d\n", usr1, usr2);
+
+    return signals == 2 && usr1 == 1 && usr2 == 1 ? 0 : -1;
+}
+
+/* A stream of signals handled outside of tinyev interrupts every wait,
+    the timer still fires about on time. */
+static int test_timer_under_eintr()
+{
+    struct itimerval it = {.it_interval = {0, ALARM_USEC}, .it_value = {0, ALARM_USEC}};
+    struct itimerval off = {{0, 0}, {0, 0}};
+    struct sigaction sa;
+    uint64_t start, took;
+    int i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = alarm_handler;
+    sigaction(SIGALRM, &sa, NULL);
+    setitimer(ITIMER_REAL, &it, NULL);
+
+    start = now_msec();
+    tinyev_add_timer(0, TIMER_MSEC, NULL, timer_cb);
+    for (i = 0; i < 10 && !fired; i++)
+        tinyev_poll(1000);
+    took = now_msec() - start;
+    setitimer(ITIMER_REAL, &off, NULL);
+    signal(SIGALRM, SIG_DFL);
+
+    printf("timer under EINTR: fired %d after %lu ms, %d alarms\n", fired, (unsigned long)took, alarms);
+
+    return fired == 1 && took < MAX_LATE_MSEC ? 0 : -1;
+}
+
+/* The loop is out of read ops, a signal must still be handled and must not
+    keep waking the loop up. */
+static int test_signal_out_of_tokens()
+{
+    struct tinyev_rate one_op = {.ops_sec = 1, .burst_ops = 1};
+    struct tinyev_stats before, after;
+    int pair[2], err, rc;
+    uint64_t start;
+    void *tev;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        printf("socketpair failed, errno %d\n", errno);
+        return -1;
+    }
+    tev = tinyev_add_reader(pair[0], NULL, 1, NULL, read_cb, &err);
+    if (!tev || tinyev_add_signal(SIGUSR1, signal_cb, NULL) ||
+        tinyev_set_rate(NULL, TINYEV_RATE_READ, &one_op))
+        return -1;
+
+    /* Takes the only token, the next read pauses the reader. */
+    if (write(pair[1], "xy", 2) != 2)
+        return -1;
+    tinyev_poll(100);
+    tinyev_poll(0);
+    raise(SIGUSR1);
+
+    tinyev_get_stats(&before);
+    start = now_msec();
+    while (now_msec() - start < RUN_MSEC)
+        tinyev_poll(POLL_MSEC);
+    tinyev_get_stats(&after);
+
+    printf("out of tokens: %d read(s), %d signal(s), %lu wakeups in %d ms\n", reads, signals,
+           (unsigned long)(after.wakeups - before.wakeups), RUN_MSEC);
+    rc = reads == 1 && signals == 1 && after.wakeups - before.wakeups < MAX_WAKEUPS ? 0 : -1;
+
+    tinyev_set_rate(NULL, TINYEV_RATE_READ, NULL);
+    tinyev_del_signal(SIGUSR1);
+    tinyev_remove_fd(pair[0], tev);
+    close(pair[1]);
+
+    return rc;
+}
+
+/* Readers paused on the loop's bytes take turns as they refill, the one
+    epoll reports first doesn't take them all. */
+static int test_paused_take_turns()
+{
+    struct tinyev_rate loop = {.bytes_sec = TURN_BYTES_SEC, .burst_bytes = 4};
+    int pair[TURN_READERS][2], turns[TURN_READERS] = {0}, total = 0, err, i, rc = 0;
+    void *tev[TURN_READERS];
+    char data[1024];
+    uint64_t start;
+
+    memset(data, 'x', sizeof(data));
+    for (i = 0; i < TURN_READERS; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair[i]) < 0 ||
+            write(pair[i][1], data, sizeof(data)) != sizeof(data))
+            return -1;
+        /* Different read sizes, none fits in what one refill brings. */
+        tev[i] = tinyev_add_reader(pair[i][0], &turns[i], TURN_READERS + 1 - i, NULL, turn_cb, &err);
+        if (!tev[i])
+            return -1;
+    }
+    if (tinyev_set_rate(NULL, TINYEV_RATE_READ, &loop))
+        return -1;
+
+    start = now_msec();
+    while (now_msec() - start < TURN_MSEC)
+        tinyev_poll(POLL_MSEC);
+
+    printf("paused take turns:");
+    for (i = 0; i < TURN_READERS; i++) {
+        printf(" %d", turns[i]);
+        total += turns[i];
+    }
+    printf(" reads\n");
+    /* Each gets about the same share. */
+    for (i = 0; i < TURN_READERS; i++) {
+        if (!total || turns[i] < total / TURN_READERS / 2)
+            rc = -1;
+    }
+
+    tinyev_set_rate(NULL, TINYEV_RATE_READ, NULL);
+    for (i = 0; i < TURN_READERS; i++) {
+        tinyev_remove_fd(pair[i][0], tev[i]);
+        close(pair[i][1]);
+    }
+
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    int rc = 0;
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        return -1;
+    }
+
+    if (test_signal_out_of_tokens())
+        rc = -1;
+    if (test_signal_delivery())
+        rc = -1;
+    if (test_timer_under_eintr())
+        rc = -1;
+    if (test_paused_take_turns())
+        rc = -1;
+
+    tinyev_cleanup();
+    printf("%s\n", rc ? "FAILED" : "PASSED");
+
+    return rc;
+}
@@ -9,6 +9,7 @@
 
 #include "tests.h"
 #include "tinyev.h"
+#include "tinyev_frame.h"
 
 #define MIN_PORT 1024
 #define MAX_PORT 65535
@@ -52,7 +53,8 @@ void timer_cb(void *udata)
     free(tdata);
 }
 
-void ev_cb(void *udata)
+/* Called with one line at a time, however the bytes were split by read. */
+void ev_cb(void *udata, const char *frame, ssize_t len)
 {
     struct event_data *data = udata;
     struct timer_data *tdata;
@@ -60,18 +62,22 @@ void ev_cb(void *udata)
     char *p;
     int bytes, delay;
 
-    bytes = read(data->fd, buf, BUF_SIZE);
-    if (bytes == -1) {
-        printf("read failed with errno %d", errno);
+    if (!frame && len == TINYEV_EOF) {
+        // EOF
+        printf("Connection closed\n");
         goto err;
     }
 
-    if (bytes == 0) {
-        // EOF
-        printf("Connection closed\n");
+    if (!frame) {
+        printf("read failed with error %zd", -len);
         goto err;
     }
 
+    /* Put the newline back, the commands below expect it. */
+    bytes = len < BUF_SIZE - 2 ? len : BUF_SIZE - 2;
+    memcpy(buf, frame, bytes);
+    buf[bytes++] = '\n';
+
     printf("Received data %.*s, %d bytes\n", bytes - 1, buf, bytes);
 
     if (strncmp(buf, CMD, sizeof(CMD)-1) == 0) {
@@ -112,7 +118,7 @@ void ev_cb(void *udata)
     return;
 err:
 
-    tinyev_remove_fd(data->fd, data->tev);
+    tinyev_remove_framed(data->fd, data->tev);
 }
 
 void listen_cb(void *udata)
@@ -121,6 +127,7 @@ void listen_cb(void *udata)
     struct event_data *new;
     int client_sock, client_size;
     struct sockaddr_in client_addr;
+    struct tinyev_frame_opts opts = {.mode = TINYEV_FRAME_DELIM, .delim = '\n', .max_frame = BUF_SIZE};
     int err;
 
     printf("Listen event, fd %d\n", data->fd);
@@ -137,7 +144,7 @@ void listen_cb(void *udata)
 
     new = malloc(sizeof(struct event_data));
     new->fd = client_sock;
-    new->tev = tinyev_add_fd(client_sock, new, ev_cb, TEV_RECV | TEV_CLOSE | TEV_ERROR, &err);
+    new->tev = tinyev_add_framed(client_sock, &opts, ev_cb, new, &err);
     if (!new->tev) {
         printf("Failed to add fd, err %d", err);
         return;
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tinyev.h"
+
+#define TEST_PORT 23470
+#define SEND_MSEC 1
+#define BUSY_EVERY_MSEC 20          // Callback that keeps the loop busy
+#define BUSY_MSEC 5
+#define RUN_MSEC 1000
+#define MSG_SIZE 64
+
+/* Datagrams, so every message is a read of its own with its own stamp. */
+static int client_fd, server_fd;
+static void *server_tev;
+static char msg[MSG_SIZE];
+static uint64_t sent = 0, received = 0, tx_stamps = 0, rx_missing = 0, rx_stamped = 0;
+static uint32_t last_id = 0;
+static bool ids_ok = true, stop = false;
+
+static double now_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void send_cb(void *udata)
+{
+    if (write(client_fd, msg, MSG_SIZE) == MSG_SIZE)
+        sent++;
+}
+
+/* Stands in for slow user code, reads pile up meanwhile. */
+static void busy_cb(void *udata)
+{
+    double until = now_msec() + BUSY_MSEC;
+
+    while (now_msec() < until);
+}
+
+static void stop_cb(void *udata)
+{
+    stop = true;
+}
+
+static void tx_cb(void *udata, uint32_t id, const struct timespec *ts)
+{
+    /* Datagram sends are counted from 0, one id each. */
+    if (id != (tx_stamps ? last_id + 1 : 0))
+        ids_ok = false;
+    last_id = id;
+    tx_stamps++;
+}
+
+static void client_cb(void *udata)
+{
+}
+
+static void read_cb(void *udata, ssize_t nread, struct tinyev_buf *buf)
+{
+    struct timespec ts;
+
+    if (nread > 0) {
+        received++;
+        if (tinyev_rx_timestamp(server_tev, &ts))
+            rx_stamped++;
+        else
+            rx_missing++;
+    }
+
+    tinyev_buf_free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr = {0};
+    struct tinyev_stats st;
+    struct tinyev_hist delay;
+    void *client_tev;
+    int err, rc, i;
+
+    memset(msg, 'x', MSG_SIZE);
+
+    if (tinyev_init()) {
+        printf("Failed to init tinyev\n");
+        return -1;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TEST_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    server_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        printf("Cannot bind, errno %d\n", errno);
+        return -1;
+    }
+    server_tev = tinyev_add_reader(server_fd, NULL, 0, NULL, read_cb, &err);
+    if (!server_tev || tinyev_set_timestamping(server_tev, TINYEV_TS_RX, NULL)) {
+        printf("Failed to set RX timestamping\n");
+        return -1;
+    }
+
+    client_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (connect(client_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        printf("Cannot connect, errno %d\n", errno);
+        return -1;
+    }
+
+    /* Errors only, TX timestamps wake the loop through the error queue. */
+    client_tev = tinyev_add_fd(client_fd, NULL, client_cb, TEV_ERROR, &err);
+    if (!client_tev || tinyev_set_timestamping(client_tev, TINYEV_TS_TX, tx_cb)) {
+        printf("Failed to set TX timestamping\n");
+        return -1;
+    }
+
+    /* Only the reads of this run. */
+    tinyev_reset_rx_delay();
+    tinyev_add_periodic(0, SEND_MSEC, NULL, send_cb);
+    tinyev_add_periodic(0, BUSY_EVERY_MSEC, NULL, busy_cb);
+    tinyev_add_timer(0, RUN_MSEC, NULL, stop_cb);
+
+    while (!stop)
+        tinyev_poll(100);
+    /* Last timestamps and data. */
+    for (i = 0; i < 100 && (received < sent || tx_stamps < sent); i++)
+        tinyev_poll(10);
+
+    tinyev_get_stats(&st);
+    tinyev_get_rx_delay(&delay);
+
+    printf("sent %lu messages, received %lu, %lu TX timestamps, %lu stamped reads, %lu without\n",
+           sent, received, tx_stamps, rx_stamped, rx_missing);
+    printf("kernel RX to callback usec: min %.1f  p50 %.1f  p99 %.1f  max %.1f\n",
+           delay.min / 1e3, tinyev_hist_percentile(&delay, 50) / 1e3,
+           tinyev_hist_percentile(&delay, 99) / 1e3, delay.max / 1e3);
+
+    /* The busy callback holds reads back for up to BUSY_MSEC. */
+    rc = !(sent && received == sent && rx_stamped == sent && st.rx_stamped == sent &&
+           tx_stamps == sent && ids_ok && delay.min > 0 &&
+           tinyev_hist_percentile(&delay, 100) >= BUSY_MSEC * 1000000ULL / 2);
+    printf("%s\n", rc ? "FAILED" : "PASSED");
+
+    tinyev_remove_fd(client_fd, client_tev);
+    tinyev_remove_fd(server_fd, server_tev);
+    tinyev_cleanup();
+
+    return rc;
+}